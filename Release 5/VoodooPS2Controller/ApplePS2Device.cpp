@@ -89,6 +89,13 @@ UInt8 ApplePS2Device::setCommandByte(UInt8 setBits, UInt8 clearBits)
 
 // - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
 
+void ApplePS2Device::sleepSinceWake(UInt32 ms)
+{
+    _controller->sleepSinceWake(ms);
+}
+
+// - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+
 void ApplePS2Device::lock()
 {
     _controller->lock();
@@ -153,3 +160,8 @@ void ApplePS2Device::dispatchKeyboardMessage(int message, void *data)
     _controller->dispatchMessage(kDT_Keyboard, message, data);
 }
 
+PS2KeyState* ApplePS2Device::getKeyState()
+{
+    return _controller->getKeyState();
+}
+
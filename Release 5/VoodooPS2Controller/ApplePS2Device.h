@@ -28,6 +28,7 @@
 #include <IOKit/IOService.h>
 #include <IOKit/IOLib.h>
 #include <architecture/i386/pio.h>
+#include <libkern/OSAtomic.h>
 
 #ifdef DEBUG_MSG
 #define DEBUG_LOG(args...)  do { IOLog(args); } while (0)
@@ -174,17 +175,22 @@
 //
 // Standard FIFO ring buffer implemented as an array.
 //
-// Note: there is no error checking in this class.  And no check for
-// overflow/underflow conditions.  Make sure you have a large enough
-// buffer to handle your needs.  And don't advance or try to fetch
-// data that doesn't exist (need to check result from count() first)
+// It is single producer/single consumer: the interrupt routine is the only
+// writer of the head (push/advanceHead) and the workloop is the only writer
+// of the tail (fetch/advanceTail).  Each side publishes its index with release
+// semantics and reads the other side's index with acquire semantics, so the
+// data in the buffer is always visible before the index that covers it.
+// reset() is not synchronized and is only for when the producer is idle.
 //
-// This class is written for simplicity and efficiency, not to be
-// user friendly.
+// When the buffer is full, new data is dropped (not overwritten) and
+// counted.  The deepest the buffer has been (high-water mark) is also kept,
+// so a buffer that is too small shows up in ioreg (see publishStatistics).
 //
 // The tail and head buffer can be accessed directly for effeciency,
 // but there are no provisions for dealing with "wrap-around," so it
 // is best that your buffer size is a mutliple of the packet size.
+// Don't advance or try to fetch data that doesn't exist (need to check
+// result from count() first).
 //
 
 template <class T, unsigned N>
@@ -192,42 +198,63 @@ class RingBuffer
 {
 private:
     T m_buffer[N];
-    volatile unsigned m_head;   // m_head is volatile: commonly accessed at interrupt time
-    unsigned m_tail;
-    unsigned count(unsigned head, unsigned tail)
+    unsigned m_head;            // written by producer (interrupt time)
+    unsigned m_tail;            // written by consumer (workloop)
+    UInt32 m_highWater;         // written by producer
+    UInt32 m_dropped;           // written by producer
+    UInt32 m_publishedHighWater;
+    UInt32 m_publishedDropped;
+    
+    static inline unsigned count(unsigned head, unsigned tail)
     {
         if (head >= tail)
             return head - tail;
         else
             return N - tail + head;
     }
+    static inline unsigned wrap(unsigned index)
+    {
+        return index >= N ? index - N : index;
+    }
+    inline unsigned loadHead() { return __atomic_load_n(&m_head, __ATOMIC_ACQUIRE); }
+    inline unsigned loadTail() { return __atomic_load_n(&m_tail, __ATOMIC_ACQUIRE); }
+    void publishHead(unsigned head, unsigned tail)
+    {
+        unsigned depth = count(head, tail);
+        if (depth > m_highWater)
+            __atomic_store_n(&m_highWater, depth, __ATOMIC_RELAXED);
+        __atomic_store_n(&m_head, head, __ATOMIC_RELEASE);
+    }
+    inline void drop() { __atomic_store_n(&m_dropped, m_dropped + 1, __ATOMIC_RELAXED); }
     
 public:
-    inline RingBuffer() { reset(); }
+    inline RingBuffer() { reset(); resetStatistics(); }
     void reset()
     {
         m_head = 0;
         m_tail = 0;
     }
-    inline unsigned count() { return count(m_head, m_tail); }
+    inline unsigned count() { return count(loadHead(), loadTail()); }
     void push(T data)
     {
         // add new data to head, check for overflow.
-        unsigned new_head = m_head + 1;
-        if (new_head >= N)
-            new_head = 0;
-        if (new_head != m_tail)
+        unsigned head = m_head;
+        unsigned tail = loadTail();
+        unsigned new_head = wrap(head + 1);
+        if (new_head == tail)
         {
-            m_buffer[m_head] = data;
-            m_head = new_head;
+            drop();
+            return;
         }
+        m_buffer[head] = data;
+        publishHead(new_head, tail);
     }
     T fetch()
     {
         // grab new data from tail, no check for underflow.
-        T result = m_buffer[m_tail++];
-        if (m_tail >= N)
-            m_tail = 0;
+        unsigned tail = m_tail;
+        T result = m_buffer[tail];
+        __atomic_store_n(&m_tail, wrap(tail + 1), __ATOMIC_RELEASE);
         return result;
     }
     inline T* head() { return &m_buffer[m_head]; }
@@ -235,18 +262,329 @@ public:
     void advanceHead(unsigned move)
     {
         // advance head by specified amount, check for overflow
-        unsigned new_head = m_head + move;
-        if (new_head >= N)
-            new_head -= N;
-        if (count(new_head, m_tail) >= count())
-            m_head = new_head;
+        unsigned head = m_head;
+        unsigned tail = loadTail();
+        unsigned new_head = wrap(head + move);
+        if (count(new_head, tail) < count(head, tail))
+        {
+            // would run into (or over) the tail: the data at head() is dropped
+            drop();
+            return;
+        }
+        publishHead(new_head, tail);
     }
     void advanceTail(unsigned move)
     {
         // advance tail by specified amount, no check for underflow.
-        m_tail += move;
-        if (m_tail >= N)
-            m_tail -= N;
+        __atomic_store_n(&m_tail, wrap(m_tail + move), __ATOMIC_RELEASE);
+    }
+    
+    // statistics (read from the consumer side)
+    inline unsigned size() { return N; }
+    inline UInt32 highWater() { return __atomic_load_n(&m_highWater, __ATOMIC_RELAXED); }
+    inline UInt32 dropped() { return __atomic_load_n(&m_dropped, __ATOMIC_RELAXED); }
+    void resetStatistics()
+    {
+        m_highWater = 0;
+        m_dropped = 0;
+        m_publishedHighWater = m_publishedDropped = (UInt32)-1;
+    }
+    void publishStatistics(IOService* service)
+    {
+        // Called by the consumer after draining.  The values only change when
+        // the buffer gets deeper than ever before or overflows, so the property
+        // is rarely updated.
+        UInt32 highwater = highWater(), drops = dropped();
+        if (highwater == m_publishedHighWater && drops == m_publishedDropped)
+            return;
+        m_publishedHighWater = highwater;
+        m_publishedDropped = drops;
+        if (OSDictionary* dict = OSDictionary::withCapacity(3))
+        {
+            const struct {const char* name; UInt32 value;} values[]={
+                {"Size",                        N},
+                {"HighWater",                   highwater},
+                {"Dropped",                     drops},
+            };
+            for (int i = 0; i < countof(values); i++)
+            {
+                if (OSNumber* num = OSNumber::withNumber(values[i].value, 32))
+                {
+                    dict->setObject(values[i].name, num);
+                    num->release();
+                }
+            }
+            service->setProperty("RingBuffer", dict);
+            dict->release();
+        }
+    }
+};
+
+// - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+// TimeHistogram
+//
+// Histogram of elapsed times in nanoseconds, with power of two buckets
+// (bucket i counts samples in [2^i, 2^(i+1)) ns).  Cheap enough to update
+// for every packet, even at interrupt time.
+//
+// Percentiles are reported as the upper bound of the bucket they fall in,
+// which is as precise as a log scale gets, but good enough to tell 10us
+// from 10ms.
+//
+
+class TimeHistogram
+{
+public:
+    enum { kBuckets = 32 };     // 2^32 ns is about 4 seconds
+    
+private:
+    UInt32 m_buckets[kBuckets];
+    uint64_t m_count;
+    uint64_t m_total;
+    uint64_t m_max;
+    
+public:
+    inline TimeHistogram() { reset(); }
+    void reset()
+    {
+        bzero(m_buckets, sizeof(m_buckets));
+        m_count = 0;
+        m_total = 0;
+        m_max = 0;
+    }
+    void add(uint64_t ns)
+    {
+        int bucket = ns ? 63 - __builtin_clzll(ns) : 0;
+        if (bucket >= kBuckets)
+            bucket = kBuckets - 1;
+        ++m_buckets[bucket];
+        ++m_count;
+        m_total += ns;
+        if (ns > m_max)
+            m_max = ns;
+    }
+    inline uint64_t count() { return m_count; }
+    uint64_t percentile(unsigned pct)
+    {
+        // upper bound of the bucket containing the pct'th percentile sample
+        uint64_t target = (m_count * pct + 99) / 100;
+        uint64_t sum = 0;
+        for (int i = 0; i < kBuckets; i++)
+        {
+            sum += m_buckets[i];
+            if (sum && sum >= target)
+                return 2ULL << i;
+        }
+        return 0;
+    }
+    OSDictionary* copyDictionary()
+    {
+        // caller must release the result
+        OSDictionary* dict = OSDictionary::withCapacity(7);
+        if (!dict)
+            return NULL;
+        const struct {const char* name; uint64_t value;} values[]={
+            {"Count",                       m_count},
+            {"TotalNS",                     m_total},
+            {"AverageNS",                   m_count ? m_total / m_count : 0},
+            {"MaxNS",                       m_max},
+            {"P50NS",                       percentile(50)},
+            {"P99NS",                       percentile(99)},
+        };
+        for (int i = 0; i < countof(values); i++)
+        {
+            if (OSNumber* num = OSNumber::withNumber(values[i].value, 64))
+            {
+                dict->setObject(values[i].name, num);
+                num->release();
+            }
+        }
+        // trim empty buckets at the top to keep ioreg output readable
+        int last = kBuckets;
+        while (last > 0 && !m_buckets[last-1])
+            --last;
+        if (OSArray* array = OSArray::withCapacity(last ? last : 1))
+        {
+            for (int i = 0; i < last; i++)
+            {
+                if (OSNumber* num = OSNumber::withNumber(m_buckets[i], 32))
+                {
+                    array->setObject(num);
+                    num->release();
+                }
+            }
+            dict->setObject("Buckets", array);
+            array->release();
+        }
+        return dict;
+    }
+};
+
+// - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+// StageTimer
+//
+// Scoped timer that adds the time spent in the enclosing block to a
+// TimeHistogram when it goes out of scope.
+//
+
+class StageTimer
+{
+private:
+    TimeHistogram& m_histogram;
+    uint64_t m_start;
+    
+public:
+    inline StageTimer(TimeHistogram& histogram) : m_histogram(histogram)
+        { clock_get_uptime(&m_start); }
+    inline ~StageTimer()
+    {
+        uint64_t now_abs, elapsed_ns;
+        clock_get_uptime(&now_abs);
+        absolutetime_to_nanoseconds(now_abs - m_start, &elapsed_ns);
+        m_histogram.add(elapsed_ns);
+    }
+};
+
+// - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+// LatencyHistogram
+//
+// Interrupt-to-event latency of a device, as published in the "Latency"
+// property and cleared with setProperties (ResetLatency=true).
+//
+// Devices that do not timestamp their packets call byteReceived from
+// interruptOccurred, which remembers when the oldest byte not yet drained
+// came in.  packetReady takes that stamp with beginDrain and hands it back
+// to endDrain once the events are dispatched.  That gives one sample per
+// drain, for the byte that waited the longest.
+//
+// Devices that do timestamp packets (keyboard) call addSince per packet.
+//
+
+#define kLatency                "Latency"
+#define kResetLatency           "ResetLatency"
+
+class LatencyHistogram : public TimeHistogram
+{
+public:
+    enum { kPublishInterval = 64 };     // samples between property updates
+    
+private:
+    uint64_t m_pending;     // uptime of oldest undrained byte (0=none)
+    
+public:
+    inline LatencyHistogram() : m_pending(0) {}
+    
+    // producer side (interrupt time)
+    inline void byteReceived()
+    {
+        if (__atomic_load_n(&m_pending, __ATOMIC_RELAXED))
+            return;
+        uint64_t now_abs, none = 0;
+        clock_get_uptime(&now_abs);
+        __atomic_compare_exchange_n(&m_pending, &none, now_abs, false, __ATOMIC_RELAXED, __ATOMIC_RELAXED);
+    }
+    
+    // consumer side (workloop)
+    inline uint64_t beginDrain()
+        { return __atomic_exchange_n(&m_pending, 0, __ATOMIC_RELAXED); }
+    inline void endDrain(uint64_t start_abs, IOService* service)
+    {
+        if (start_abs)
+            addSince(start_abs, service);
+    }
+    void addSince(uint64_t start_abs, IOService* service)
+    {
+        uint64_t now_abs, elapsed_ns;
+        clock_get_uptime(&now_abs);
+        absolutetime_to_nanoseconds(now_abs - start_abs, &elapsed_ns);
+        add(elapsed_ns);
+        if (!(count() % kPublishInterval))
+            publish(service);
+    }
+    void publish(IOService* service)
+    {
+        if (OSDictionary* dict = copyDictionary())
+        {
+            service->setProperty(kLatency, dict);
+            dict->release();
+        }
+    }
+};
+
+// - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+// InputStatistics
+//
+// Health counters of a device, as published in the "Statistics" property and
+// cleared with setProperties (ResetStatistics=true), so failing hardware can
+// be spotted without verbose logging.
+//
+// Each counter has a single writer: bytes and framing errors are counted by
+// interruptOccurred, packets by packetReady.  update is called by packetReady
+// after draining.  Ring buffer depth and overflows are not repeated here; they
+// are in the "RingBuffer" property (see RingBuffer::publishStatistics).
+//
+
+#define kStatistics             "Statistics"
+#define kResetStatistics        "ResetStatistics"
+
+class InputStatistics
+{
+public:
+    enum { kPublishInterval = 256 };    // packets between property updates
+    enum
+    {
+        kBytes,             // bytes received
+        kPackets,           // packets dispatched
+        kResyncs,           // framing lost, bytes skipped to regain it
+        kRejects,           // invalid packets (or bytes) dropped
+        kSmashed,           // packets with a smashed last byte (ALPS Rushmore)
+        kResets,            // spontaneous device resets ($AA $00)
+        kCount,
+        kFirstError = kResyncs,
+    };
+    
+private:
+    UInt32 m_counters[kCount];
+    UInt32 m_published[kCount];
+    
+public:
+    inline InputStatistics() { reset(); }
+    void reset()
+    {
+        bzero(m_counters, sizeof(m_counters));
+        bzero(m_published, sizeof(m_published));
+    }
+    inline void count(int counter)
+        { __atomic_store_n(&m_counters[counter], m_counters[counter] + 1, __ATOMIC_RELAXED); }
+    inline UInt32 get(int counter)
+        { return __atomic_load_n(&m_counters[counter], __ATOMIC_RELAXED); }
+    void update(IOService* service)
+    {
+        // errors are published right away, everything else periodically
+        bool changed = get(kPackets) - m_published[kPackets] >= kPublishInterval;
+        for (int i = kFirstError; !changed && i < kCount; i++)
+            changed = get(i) != m_published[i];
+        if (changed)
+            publish(service);
+    }
+    void publish(IOService* service)
+    {
+        static const char* names[kCount] =
+            { "Bytes", "Packets", "Resyncs", "Rejects", "Smashed", "Resets" };
+        OSDictionary* dict = OSDictionary::withCapacity(kCount);
+        if (!dict)
+            return;
+        for (int i = 0; i < kCount; i++)
+        {
+            m_published[i] = get(i);
+            if (OSNumber* num = OSNumber::withNumber(m_published[i], 32))
+            {
+                dict->setObject(names[i], num);
+                num->release();
+            }
+        }
+        service->setProperty(kStatistics, dict);
+        dict->release();
     }
 };
 
@@ -488,6 +826,16 @@ public:
 //                     block the calling thread until the request completes.
 //    o  In Fields:    Request structure pointer.
 //
+// o  sleepSinceWake:
+//    o  Description:  Sleeps until the given time has passed since the call.
+//                     During a wake, queued requests are run first and the
+//                     time they take counts toward it.  Outside of a wake,
+//                     simply sleeps.
+//    o  In Fields:    Milliseconds.
+//    o  Comments:     Used by power control handlers in place of IOSleep to
+//                     wait out the device's power-on self-test, so that time
+//                     spent waking the other device counts toward the wait.
+//
 
 enum PS2InterruptResult
 {
@@ -523,7 +871,7 @@ enum
     // from keyboard to mouse/touchpad
     kPS2M_setDisableTouchpad,   // set disable/enable touchpad (data is bool*)
     kPS2M_getDisableTouchpad,   // get disable/enable touchpad (data is bool*)
-    kPS2M_notifyKeyPressed,     // notify of time key pressed (data is PS2KeyInfo*)
+    kPS2M_notifyKeyPressed,     // notify of time key pressed (data is PS2KeyInfo*, see PS2KeyState)
     
     // from mouse/touchpad to keyboard
     kPS2M_swipeDown,
@@ -538,12 +886,58 @@ enum
 
 typedef struct PS2KeyInfo
 {
-    int64_t time;
+    uint64_t time;      // absolute time (clock_get_uptime) of the key event
     UInt16  adbKeyCode;
     bool    goingDown;
     bool    eatKey;
 } PS2KeyInfo;
 
+//
+// Keyboard activity shared with the mouse/trackpad drivers.
+//
+// Rather than sending kPS2M_notifyKeyPressed for every keystroke, the keyboard
+// publishes the time of the last key and the modifier state here (one copy,
+// owned by the controller) and the mouse/trackpad reads it when it needs it.
+// There is a single writer (the keyboard), so a sequence count is enough to
+// give readers a consistent snapshot without a lock.
+//
+
+typedef struct PS2KeyState
+{
+    volatile UInt32   sequence;   // odd while the keyboard is updating
+    volatile UInt32   keyCount;   // number of non-modifier key events
+    volatile uint64_t time;       // absolute time of last key (except modifier down)
+    volatile UInt32   modifiers;  // modifier keys down (same masks as HID flags)
+} PS2KeyState;
+
+inline void beginKeyStateUpdate(PS2KeyState* state)
+{
+    ++state->sequence;
+    OSMemoryBarrier();
+}
+
+inline void endKeyStateUpdate(PS2KeyState* state)
+{
+    OSMemoryBarrier();
+    ++state->sequence;
+}
+
+inline void readKeyState(const PS2KeyState* state, PS2KeyState* copy)
+{
+    UInt32 sequence;
+    do
+    {
+        while ((sequence = state->sequence) & 1)
+            ;
+        OSMemoryBarrier();
+        copy->keyCount = state->keyCount;
+        copy->time = state->time;
+        copy->modifiers = state->modifiers;
+        OSMemoryBarrier();
+    } while (sequence != state->sequence);
+    copy->sequence = sequence;
+}
+
 
 //
 // Enumeration of 'whatToDo' values passed to power control action.
@@ -597,6 +991,7 @@ public:
     virtual bool         submitRequest(PS2Request * request);
     virtual void         submitRequestAndBlock(PS2Request * request);
     virtual UInt8        setCommandByte(UInt8 setBits, UInt8 clearBits);
+    virtual void         sleepSinceWake(UInt32 ms);
     
     // Power Control Handling Routines
     
@@ -609,6 +1004,7 @@ public:
     virtual void uninstallMessageAction();
     virtual void dispatchMouseMessage(int message, void *data);
     virtual void dispatchKeyboardMessage(int message, void *data);
+    virtual PS2KeyState* getKeyState();
     
     // Exclusive access (command byte contention)
     
@@ -340,6 +340,8 @@ bool ApplePS2Controller::init(OSDictionary* dict)
     _messageInstalledKeyboard = false;
     _messageInstalledMouse = false;
     
+    bzero(&_keyState, sizeof(_keyState));
+    
     _mouseDevice    = 0;
     _keyboardDevice = 0;
     
@@ -350,6 +352,21 @@ bool ApplePS2Controller::init(OSDictionary* dict)
 #endif
     
     _wakedelay = 10;
+    for (int i = 0; i < kRequestPoolBuckets; i++)
+    {
+        _requestPool[i] = 0;
+        _requestPoolFree[i] = 0;
+    }
+    _requestPoolHits = 0;
+    _requestPoolMisses = 0;
+    _requestPoolDrains = 0;
+    _requestPoolPublished[0] = _requestPoolPublished[1] = 0;
+    _dataWaitSpun = 0;
+    _dataWaitBackedOff = 0;
+    _dataWaitTimeouts = 0;
+    _dataWaitPublished = 0;
+    _waking = false;
+    _wakeCount = 0;
     _cmdGate = 0;
     
     _requestQueueLock = 0;
@@ -409,6 +426,14 @@ IOReturn ApplePS2Controller::setPropertiesGated(OSObject* props)
         setProperty("WakeDelay", _wakedelay, 32);
     }
     
+    // readDataPort wait statistics: snapshot on demand
+    if (dict->getObject("DataWait"))
+        publishDataWaitStatistics(true);
+    
+    // request pool statistics: snapshot on demand
+    if (dict->getObject("RequestPool"))
+        publishRequestPoolStatistics(true);
+    
     return kIOReturnSuccess;
 }
 
@@ -549,6 +574,9 @@ bool ApplePS2Controller::start(IOService * provider)
     _cmdbyteLock = IOLockAlloc();
     if (!_cmdbyteLock) goto fail;
     
+    // Preallocate requests (optional: allocateRequest falls back to the heap).
+    allocateRequestPool();
+    
     //
     // Initialize our work loop, our command gate, and our interrupt event
     // sources.  The work loop can accept requests after this step.
@@ -707,6 +735,7 @@ void ApplePS2Controller::stop(IOService * provider)
         IOLockFree(_cmdbyteLock);
         _cmdbyteLock = 0;
     }
+    freeRequestPool();
     
     // Free the power management thread call.
     if (_powerChangeThreadCall)
@@ -857,15 +886,86 @@ void ApplePS2Controller::uninstallInterruptAction(PS2DeviceType deviceType)
 
 // - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
 
+// commands per request in each pool bucket, smallest first: the sized
+// requests of the keyboard driver, and the allocateRequest() default
+static const int requestPoolCommands[kRequestPoolBuckets] = { 4, kMaxCommands };
+
+static inline size_t requestPoolStride(int bucket)
+{
+    // keep each slot pointer aligned
+    size_t size = sizeof(PS2Request) + sizeof(PS2Command)*requestPoolCommands[bucket];
+    return (size + sizeof(void*) - 1) & ~(sizeof(void*) - 1);
+}
+
+void ApplePS2Controller::allocateRequestPool()
+{
+    for (int i = 0; i < kRequestPoolBuckets; i++)
+    {
+        _requestPool[i] = (UInt8*)IOMalloc(requestPoolStride(i) * kRequestPoolSlots);
+        _requestPoolFree[i] = _requestPool[i] ? (UInt32)((1ULL << kRequestPoolSlots) - 1) : 0;
+    }
+}
+
+void ApplePS2Controller::freeRequestPool()
+{
+    //
+    // A bucket is only freed when all of its slots are free, and claiming them
+    // all at once keeps allocateRequest away from it.  A bucket with requests
+    // still outstanding is kept (and leaked), so freeRequest keeps recognizing
+    // them as pool slots instead of deleting them.
+    //
+    
+    for (int i = 0; i < kRequestPoolBuckets; i++)
+    {
+        if (!_requestPool[i])
+            continue;
+        UInt32 all = (UInt32)((1ULL << kRequestPoolSlots) - 1);
+        if (!__atomic_compare_exchange_n(&_requestPoolFree[i], &all, 0, false, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+        {
+            IOLog("%s: %d pooled requests still outstanding, not freeing their bucket\n", getName(), kRequestPoolSlots - __builtin_popcount(all));
+            continue;
+        }
+        IOFree(_requestPool[i], requestPoolStride(i) * kRequestPoolSlots);
+        _requestPool[i] = 0;
+    }
+}
+
 PS2Request * ApplePS2Controller::allocateRequest(int max)
 {
     //
     // Allocate a request structure.  Blocks until successful.
     // Most of request structure is guaranteed to be zeroed.
     //
+    // Requests come from a preallocated pool when there is a free slot
+    // big enough (smallest bucket first), otherwise from the heap.  Slots
+    // are claimed/released by clearing/setting their bit in the bucket's
+    // free mask with atomic operations, so no lock is needed.
+    //
     
     assert(max > 0);
     
+    for (int i = 0; i < kRequestPoolBuckets; i++)
+    {
+        if (max > requestPoolCommands[i])
+            continue;
+        UInt32 free = __atomic_load_n(&_requestPoolFree[i], __ATOMIC_RELAXED);
+        while (free)
+        {
+            UInt32 bit = free & -free;
+            if (__atomic_compare_exchange_n(&_requestPoolFree[i], &free, free & ~bit, true, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+            {
+                size_t stride = requestPoolStride(i);
+                PS2Request* request = (PS2Request*)(_requestPool[i] + stride * __builtin_ctz(bit));
+                // same state as a fresh heap allocation + PS2Request()
+                bzero(request, stride);
+                __atomic_fetch_add(&_requestPoolHits, 1, __ATOMIC_RELAXED);
+                return request;
+            }
+        }
+        // bucket exhausted, try a bigger one
+    }
+    
+    __atomic_fetch_add(&_requestPoolMisses, 1, __ATOMIC_RELAXED);
     return new(max) PS2Request;
 }
 
@@ -892,9 +992,48 @@ void ApplePS2Controller::freeRequest(PS2Request * request)
     // Deallocate a request structure.
     //
     
+    for (int i = 0; i < kRequestPoolBuckets; i++)
+    {
+        size_t stride = requestPoolStride(i);
+        UInt8* p = (UInt8*)request;
+        if (_requestPool[i] && p >= _requestPool[i] && p < _requestPool[i] + stride * kRequestPoolSlots)
+        {
+            __atomic_fetch_or(&_requestPoolFree[i], 1U << ((p - _requestPool[i]) / stride), __ATOMIC_RELEASE);
+            return;
+        }
+    }
+    
     delete request;
 }
 
+void ApplePS2Controller::publishRequestPoolStatistics(bool force)
+{
+    UInt32 hits = __atomic_load_n(&_requestPoolHits, __ATOMIC_RELAXED);
+    UInt32 misses = __atomic_load_n(&_requestPoolMisses, __ATOMIC_RELAXED);
+    if (!force && hits == _requestPoolPublished[0] && misses == _requestPoolPublished[1])
+        return;
+    _requestPoolPublished[0] = hits;
+    _requestPoolPublished[1] = misses;
+    
+    if (OSDictionary* dict = OSDictionary::withCapacity(2))
+    {
+        const struct {const char* name; UInt32 value;} values[]={
+            {"Hits",                        hits},
+            {"Misses",                      misses},
+        };
+        for (int i = 0; i < countof(values); i++)
+        {
+            if (OSNumber* num = OSNumber::withNumber(values[i].value, 32))
+            {
+                dict->setObject(values[i].name, num);
+                num->release();
+            }
+        }
+        setProperty("RequestPool", dict);
+        dict->release();
+    }
+}
+
 // - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
 
 UInt8 ApplePS2Controller::setCommandByte(UInt8 setBits, UInt8 clearBits)
@@ -962,6 +1101,38 @@ void ApplePS2Controller::submitRequestAndBlockGated(PS2Request* request)
 
 // - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
 
+void ApplePS2Controller::sleepSinceWake(UInt32 ms)
+{
+    _cmdGate->runAction(OSMemberFunctionCast(IOCommandGate::Action, this, &ApplePS2Controller::sleepSinceWakeGated), &ms);
+}
+
+// - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+
+void ApplePS2Controller::sleepSinceWakeGated(UInt32* ms)
+{
+    //
+    // The delay is measured from this call, as with IOSleep.  During a wake,
+    // requests queued by the other driver (keyboard init is asynchronous) are
+    // run first and the time they take counts toward the delay, overlapping
+    // them with the wait instead of adding to it.
+    //
+    
+    uint64_t wait_ns = (uint64_t)*ms * 1000000;
+    if (_waking)
+    {
+        uint64_t start_abs, now_abs, elapsed_ns;
+        clock_get_uptime(&start_abs);
+        processRequestQueue(0, 0);
+        clock_get_uptime(&now_abs);
+        absolutetime_to_nanoseconds(now_abs - start_abs, &elapsed_ns);
+        wait_ns = elapsed_ns < wait_ns ? wait_ns - elapsed_ns : 0;
+    }
+    if (wait_ns)
+        IOSleep((UInt32)((wait_ns + 999999) / 1000000));
+}
+
+// - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+
 #if HANDLE_INTERRUPT_DATA_LATER
 void ApplePS2Controller::interruptOccurred(IOInterruptEventSource* source, int)
 {                                                      // IOInterruptEventAction
@@ -1206,6 +1377,7 @@ void ApplePS2Controller::processRequest(PS2Request * request)
     // Now it is ok to process interrupts normally.
     
     --_ignoreInterrupts;
+    publishDataWaitStatistics(false);
     
 hardware_offline:
     
@@ -1254,6 +1426,100 @@ void ApplePS2Controller::processRequestQueue(IOInterruptEventSource *, int)
         queue_remove_first(&localQueue, request, PS2Request *, chain);
         processRequest(request);
     }
+    
+    // pool statistics: periodically, and only if they changed
+    if (!_hardwareOffline && !(++_requestPoolDrains % kRequestPoolPublishInterval))
+        publishRequestPoolStatistics(false);
+}
+
+// - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+
+bool ApplePS2Controller::waitForOutputReady(UInt8* status, UInt32* timeout)
+{
+    //
+    // Waits for the controller's output buffer to become ready, returning
+    // false when the remaining timeout (in microseconds, reduced by the time
+    // spent waiting here) runs out.  The time is taken from the clock, not
+    // summed from the requested delays, since IODelay can run long.
+    //
+    // Most responses arrive within a few hundred microseconds, so we busy-poll
+    // for kDataWaitSpin first.  After that the delay between polls doubles, up
+    // to kDataWaitMaxDelay.  Delays that long make IODelay block the thread
+    // instead of spinning (except with interrupts disabled, as with
+    // DEBUGGER_SUPPORT), so a slow or absent device no longer keeps a CPU busy
+    // for the whole timeout.
+    //
+    
+    uint64_t start_abs, now_abs, spin_abs, deadline_abs, elapsed_ns;
+    clock_get_uptime(&start_abs);
+    nanoseconds_to_absolutetime(kDataWaitSpin * 1000ULL, &spin_abs);
+    spin_abs += start_abs;
+    nanoseconds_to_absolutetime(*timeout * 1000ULL, &deadline_abs);
+    deadline_abs += start_abs;
+    
+    UInt32 delay = kDataDelay;
+    bool ready;
+    now_abs = start_abs;
+    while (!(ready = (*status = inb(kCommandPort)) & kOutputReady) && now_abs < deadline_abs)
+    {
+        if (now_abs >= spin_abs && delay < kDataWaitMaxDelay)
+        {
+            delay <<= 1;
+            if (delay > kDataWaitMaxDelay)
+                delay = kDataWaitMaxDelay;
+        }
+        IODelay(delay);
+        clock_get_uptime(&now_abs);
+    }
+    
+    clock_get_uptime(&now_abs);
+    if (now_abs < deadline_abs)
+    {
+        uint64_t remaining_ns;
+        absolutetime_to_nanoseconds(deadline_abs - now_abs, &remaining_ns);
+        *timeout = (UInt32)(remaining_ns / 1000);
+    }
+    else
+        *timeout = 0;
+    
+    absolutetime_to_nanoseconds(now_abs - start_abs, &elapsed_ns);
+    _dataWaitTime.add(elapsed_ns);
+    if (!ready)
+        ++_dataWaitTimeouts;
+    else if (now_abs > spin_abs)
+        ++_dataWaitBackedOff;
+    else
+        ++_dataWaitSpun;
+    
+    return ready;
+}
+
+void ApplePS2Controller::publishDataWaitStatistics(bool force)
+{
+    // publish every kDataWaitPublishInterval waits, or on demand if anything is new
+    uint64_t count = _dataWaitTime.count();
+    if (count == _dataWaitPublished || (!force && count - _dataWaitPublished < kDataWaitPublishInterval))
+        return;
+    _dataWaitPublished = count;
+    
+    if (OSDictionary* dict = _dataWaitTime.copyDictionary())
+    {
+        const struct {const char* name; UInt32 value;} values[]={
+            {"Spun",                        _dataWaitSpun},
+            {"BackedOff",                   _dataWaitBackedOff},
+            {"Timeouts",                    _dataWaitTimeouts},
+        };
+        for (int i = 0; i < countof(values); i++)
+        {
+            if (OSNumber* num = OSNumber::withNumber(values[i].value, 32))
+            {
+                dict->setObject(values[i].name, num);
+                num->release();
+            }
+        }
+        setProperty("DataWait", dict);
+        dict->release();
+    }
 }
 
 // - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
@@ -1267,15 +1533,15 @@ UInt8 ApplePS2Controller::readDataPort(PS2DeviceType deviceType)
     // driver interrupt routine immediately (effectively, the request is
     // "preempted" temporarily).
     //
-    // There is a built-in timeout for this command of (timeoutCounter X
-    // kDataDelay) microseconds, approximately.
+    // There is a built-in timeout for this command of kDataWaitTimeout
+    // microseconds, approximately (see waitForOutputReady).
     //
     // This method should only be called from our single-threaded work loop.
     //
     
     UInt8  readByte;
     UInt8  status;
-    UInt32 timeoutCounter = 10000;    // (timeoutCounter * kDataDelay = 70 ms)
+    UInt32 timeout = kDataWaitTimeout;
     
     while (1)
     {
@@ -1293,17 +1559,13 @@ UInt8 ApplePS2Controller::readDataPort(PS2DeviceType deviceType)
         // Wait for the controller's output buffer to become ready.
         //
         
-        while (timeoutCounter && !((status = inb(kCommandPort)) & kOutputReady))
-        {
-            timeoutCounter--;
-            IODelay(kDataDelay);
-        }
+        bool ready = waitForOutputReady(&status, &timeout);
         
         //
         // If we timed out, something went awfully wrong; return a fake value.
         //
         
-        if (timeoutCounter == 0)
+        if (!ready)
         {
 #if DEBUGGER_SUPPORT
             unlockController(state);  // (release interrupt lockout + access to queue)
@@ -1370,8 +1632,8 @@ UInt8 ApplePS2Controller::readDataPort(PS2DeviceType deviceType,
     // driver interrupt routine immediately (effectively, the request is
     // "preempted" temporarily).
     //
-    // There is a built-in timeout for this command of (timeoutCounter X
-    // kDataDelay) microseconds, approximately.
+    // There is a built-in timeout for this command of kDataWaitTimeout
+    // microseconds, approximately (see waitForOutputReady).
     //
     // This method should only be called from our single-threaded work loop.
     //
@@ -1388,16 +1650,17 @@ UInt8 ApplePS2Controller::readDataPort(PS2DeviceType deviceType,
     //     the first byte we read to the driver's interrupt handler,  then
     //     return the expected byte. The caller will have never known that
     //     asynchronous data arrived at a very bad time.
-    // (c) that the real "expected" response will arrive within (kDataDelay
-    //     X timeoutCounter) microseconds from the time the call is made.
+    // (c) that the real "expected" response will arrive within
+    //     kDataWaitTimeout microseconds from the time the call is made.
     //
     
     UInt8  firstByte     = 0;
     bool   firstByteHeld = false;
     UInt8  readByte;
     bool   requestedStream;
+    bool   ready;
     UInt8  status;
-    UInt32 timeoutCounter = 10000;    // (timeoutCounter * kDataDelay = 70 ms)
+    UInt32 timeout = kDataWaitTimeout;
     
     while (1)
     {
@@ -1415,11 +1678,7 @@ UInt8 ApplePS2Controller::readDataPort(PS2DeviceType deviceType,
         // Wait for the controller's output buffer to become ready.
         //
         
-        while (timeoutCounter && !((status = inb(kCommandPort)) & kOutputReady))
-        {
-            timeoutCounter--;
-            IODelay(kDataDelay);
-        }
+        ready = waitForOutputReady(&status, &timeout);
         
         //
         // If we timed out, we return the first byte we read, unless THIS IS the
@@ -1427,7 +1686,7 @@ UInt8 ApplePS2Controller::readDataPort(PS2DeviceType deviceType,
         // and we return a fake value rather than lock up the controller longer.
         //
         
-        if (timeoutCounter == 0)
+        if (!ready)
         {
 #if DEBUGGER_SUPPORT
             unlockController(state);  // (release interrupt lockout + access to queue)
@@ -1869,8 +2128,14 @@ void ApplePS2Controller::setPowerStateGated( UInt32 powerState )
                     break;
                 }
                 
+                // (timestamps for each phase, see publishWakeTimings)
+                uint64_t phases[kWakePhaseCount+1];
+                clock_get_uptime(&phases[0]);
+                _waking = true;
+                
                 if (_wakedelay)
                     IOSleep(_wakedelay);
+                clock_get_uptime(&phases[kWakePhaseDelay+1]);
                 
 #if FULL_INIT_AFTER_WAKE
                 //
@@ -1880,6 +2145,7 @@ void ApplePS2Controller::setPowerStateGated( UInt32 powerState )
                 resetController();
                 
 #endif // FULL_INIT_AFTER_WAKE
+                clock_get_uptime(&phases[kWakePhaseReset+1]);
                 
                 
                 //
@@ -1899,14 +2165,24 @@ void ApplePS2Controller::setPowerStateGated( UInt32 powerState )
                 // 3. Notify clients about the state change: Keyboard, then Mouse.
                 //   (This ordering is also part of the fix for ProBook 4x40s trackpad wake issue)
                 
+                //    The keyboard queues its init asynchronously; the mouse driver
+                //    runs that queue while it waits for its device (see
+                //    sleepSinceWake), and whatever is left is run here.
+                
                 dispatchDriverPowerControl( kPS2C_EnableDevice, kDT_Keyboard );
+                clock_get_uptime(&phases[kWakePhaseKeyboard+1]);
                 dispatchDriverPowerControl( kPS2C_EnableDevice, kDT_Mouse );
+                processRequestQueue(0, 0);
+                clock_get_uptime(&phases[kWakePhaseMouse+1]);
+                _waking = false;
                 
                 // 4. Now safe to enable the IRQs...
                 
                 DEBUG_LOG("%s: setCommandByte for wake 2\n", getName());
                 setCommandByte(kCB_EnableKeyboardIRQ | kCB_EnableMouseIRQ | kCB_SystemFlag, 0);
                 --_ignoreInterrupts;
+                
+                publishWakeTimings(phases);
                 break;
                 
             default:
@@ -1927,6 +2203,46 @@ void ApplePS2Controller::setPowerStateGated( UInt32 powerState )
 
 // - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
 
+void ApplePS2Controller::publishWakeTimings(const uint64_t* phases)
+{
+    //
+    // Publishes the duration of each phase of the last wake, in nanoseconds,
+    // given the start time followed by the end time of each phase.
+    //
+    
+    static const char* names[kWakePhaseCount] = { "Delay", "Reset", "Keyboard", "Mouse" };
+    
+    OSDictionary* dict = OSDictionary::withCapacity(kWakePhaseCount+2);
+    if (!dict)
+        return;
+    
+    uint64_t ns;
+    for (int i = 0; i < kWakePhaseCount; i++)
+    {
+        absolutetime_to_nanoseconds(phases[i+1] - phases[i], &ns);
+        if (OSNumber* num = OSNumber::withNumber(ns, 64))
+        {
+            dict->setObject(names[i], num);
+            num->release();
+        }
+    }
+    absolutetime_to_nanoseconds(phases[kWakePhaseCount] - phases[0], &ns);
+    if (OSNumber* num = OSNumber::withNumber(ns, 64))
+    {
+        dict->setObject("Total", num);
+        num->release();
+    }
+    if (OSNumber* num = OSNumber::withNumber(++_wakeCount, 32))
+    {
+        dict->setObject("Count", num);
+        num->release();
+    }
+    setProperty("WakeTimings", dict);
+    dict->release();
+}
+
+// - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+
 void ApplePS2Controller::dispatchDriverPowerControl( UInt32 whatToDo, PS2DeviceType deviceType )
 {
     if (kDT_Mouse == deviceType && _powerControlInstalledMouse)
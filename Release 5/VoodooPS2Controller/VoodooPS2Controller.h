@@ -126,6 +126,27 @@ class ApplePS2MouseDevice;
 // Port timings.
 
 #define kDataDelay              7       // usec to delay before data is valid
+#define kDataWaitSpin           200     // usec to busy-poll for data before backing off
+#define kDataWaitMaxDelay       1000    // usec, longest delay between polls when backed off
+#define kDataWaitTimeout        70000   // usec before readDataPort gives up
+#define kDataWaitPublishInterval 64     // waits between DataWait updates
+
+// PS2Request pool (see allocateRequest).
+
+#define kRequestPoolBuckets     2       // 4 and kMaxCommands commands
+#define kRequestPoolSlots       8       // requests per bucket (32 max, see _requestPoolFree)
+#define kRequestPoolPublishInterval 64  // queue drains between RequestPool updates
+
+// Phases of wake from sleep (see publishWakeTimings).
+
+enum
+{
+    kWakePhaseDelay,        // _wakedelay
+    kWakePhaseReset,        // resetController (FULL_INIT_AFTER_WAKE)
+    kWakePhaseKeyboard,     // keyboard power control (queues its init)
+    kWakePhaseMouse,        // mouse power control, then any queued requests
+    kWakePhaseCount
+};
 
 // Ports used to control the PS/2 keyboard/mouse and read data from it.
 
@@ -225,6 +246,8 @@ private:
   bool                     _messageInstalledKeyboard;
   bool                     _messageInstalledMouse;
 
+  PS2KeyState              _keyState;             // published by keyboard
+
   ApplePS2MouseDevice *    _mouseDevice;          // mouse nub
   ApplePS2KeyboardDevice * _keyboardDevice;       // keyboard nub
 
@@ -248,6 +271,25 @@ private:
 #endif
   int                      _wakedelay;
   IOCommandGate*           _cmdGate;
+
+  // preallocated PS2Request objects, one block of kRequestPoolSlots per bucket
+  UInt8*                   _requestPool[kRequestPoolBuckets];
+  UInt32                   _requestPoolFree[kRequestPoolBuckets];  // bit set = slot free
+  UInt32                   _requestPoolHits;
+  UInt32                   _requestPoolMisses;
+  UInt32                   _requestPoolDrains;
+  UInt32                   _requestPoolPublished[2];   // hits/misses last published
+
+  // readDataPort wait statistics (see waitForOutputReady)
+  TimeHistogram            _dataWaitTime;
+  UInt32                   _dataWaitSpun;         // data arrived while busy-polling
+  UInt32                   _dataWaitBackedOff;    // data arrived after backing off
+  UInt32                   _dataWaitTimeouts;
+  uint64_t                 _dataWaitPublished;    // _dataWaitTime.count() last published
+
+  // wake from sleep (see setPowerStateGated and sleepSinceWake)
+  bool                     _waking;               // between wake and enabling the IRQs
+  UInt32                   _wakeCount;
 #if WATCHDOG_TIMER
   IOTimerEventSource*      _watchdogTimer;
 #endif
@@ -268,6 +310,12 @@ private:
   virtual void  processRequestQueue(IOInterruptEventSource *, int);
 
   virtual UInt8 readDataPort(PS2DeviceType deviceType);
+  bool waitForOutputReady(UInt8* status, UInt32* timeout);
+  void publishDataWaitStatistics(bool force);
+  void allocateRequestPool();
+  void freeRequestPool();
+  void publishRequestPoolStatistics(bool force);
+  void publishWakeTimings(const uint64_t* phases);
   virtual void  writeCommandPort(UInt8 byte);
   virtual void  writeDataPort(UInt8 byte);
   void resetController(void);
@@ -294,6 +342,7 @@ private:
 #endif
   IOReturn setPropertiesGated(OSObject* props);
   void submitRequestAndBlockGated(PS2Request* request);
+  void sleepSinceWakeGated(UInt32* ms);
 
 public:
   virtual bool init(OSDictionary * properties);
@@ -314,6 +363,7 @@ public:
   virtual void         submitRequestAndBlock(PS2Request * request);
   virtual UInt8        setCommandByte(UInt8 setBits, UInt8 clearBits);
   void setCommandByteGated(PS2Request* request);
+  virtual void         sleepSinceWake(UInt32 ms);
 
   virtual IOReturn setPowerState(unsigned long powerStateOrdinal,
                                  IOService *   policyMaker);
@@ -330,6 +380,7 @@ public:
     
   virtual void uninstallMessageAction(PS2DeviceType deviceType);
   virtual void dispatchMessage(PS2DeviceType deviceType, int message, void* data);
+  inline PS2KeyState* getKeyState() { return &_keyState; }
     
   virtual IOReturn setProperties(OSObject* props);
   virtual void lock();
@@ -183,6 +183,48 @@ static void SignalHandler1(int sigraised)
     _exit(0);
 }
 
+// PrintStatistic
+//
+// CFDictionaryApplierFunction used by PrintStatistics to print one counter
+
+static void PrintStatistic(const void* key, const void* value, void* context)
+{
+    char name[64];
+    long long number;
+    if (CFGetTypeID(key) != CFStringGetTypeID() || CFGetTypeID(value) != CFNumberGetTypeID())
+        return;
+    if (!CFStringGetCString((CFStringRef)key, name, sizeof(name), kCFStringEncodingUTF8))
+        return;
+    if (CFNumberGetValue((CFNumberRef)value, kCFNumberLongLongType, &number))
+        printf("    %s = %lld\n", name, number);
+}
+
+// PrintStatistics
+//
+// Prints the "Statistics" property (packets, resyncs, rejects, resets, etc.) of
+// each PS/2 driver that is loaded.  Invoked with -s from the command line.
+
+static int PrintStatistics()
+{
+    static const char* drivers[] = { "ApplePS2Keyboard", "ApplePS2Mouse", "ApplePS2SynapticsTouchPad", "ApplePS2ALPSGlidePoint" };
+    for (int i = 0; i < sizeof(drivers)/sizeof(drivers[0]); i++)
+    {
+        io_service_t service = IOServiceGetMatchingService(0, IOServiceMatching(drivers[i]));
+        if (!service)
+            continue;
+        CFTypeRef prop = IORegistryEntryCreateCFProperty(service, CFSTR("Statistics"), kCFAllocatorDefault, 0);
+        if (prop)
+        {
+            printf("%s:\n", drivers[i]);
+            if (CFGetTypeID(prop) == CFDictionaryGetTypeID())
+                CFDictionaryApplyFunction((CFDictionaryRef)prop, PrintStatistic, NULL);
+            CFRelease(prop);
+        }
+        IOObjectRelease(service);
+    }
+    return 0;
+}
+
 // main
 //
 // Entry point from command line or (eventually) launchd LaunchDaemon
@@ -190,6 +232,9 @@ static void SignalHandler1(int sigraised)
 
 int main(int argc, const char *argv[])
 {
+    if (argc > 1 && 0 == strcmp(argv[1], "-s"))
+        return PrintStatistics();
+    
     time_t current_time = time(NULL);
     char* c_time_string = ctime(&current_time);
     size_t l = strlen(c_time_string);
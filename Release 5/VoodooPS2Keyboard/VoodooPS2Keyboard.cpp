@@ -69,6 +69,12 @@ void* _org_rehabman_dontstrip_[] =
 #define kMacroInversion                     "Macro Inversion"
 #define kMacroTranslation                   "Macro Translation"
 #define kMaxMacroTime                       "MaximumMacroTime"
+#ifdef DEBUG
+#define kCaptureScanCodes                   "CaptureScanCodes"
+#define kScanCodeCapture                    "ScanCodeCapture"
+#define kReplayScanCodes                    "ReplayScanCodes"
+#define kReplayResults                      "ReplayResults"
+#endif
 
 // Definitions for Macro Inversion data format
 //REVIEW: This should really be defined as some sort of structure
@@ -195,6 +201,29 @@ static void logKeySequence(const char* header, UInt16* pAction)
 }
 #endif
 
+// keys setParamPropertiesGated handles by changing _PS2ToPS2Map or _PS2ToADBMap
+static bool hasKeyMapKeys(OSDictionary* dict)
+{
+    static const char* keys[] =
+    {
+        kHIDFKeyMode,
+        kSwapCapsLockLeftControl,
+        kSwapCommandOption,
+        kMakeApplicationKeyRightWindows,
+        kMakeApplicationKeyAppleFN,
+        kMakeRightModsHangulHanja,
+        kUseISOLayoutKeyboard,
+    };
+    if (!dict)
+        return false;
+    for (int i = 0; i < countof(keys); i++)
+    {
+        if (dict->getObject(keys[i]))
+            return true;
+    }
+    return false;
+}
+
 // - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
 
 bool ApplePS2Keyboard::init(OSDictionary * dict)
@@ -227,6 +256,7 @@ bool ApplePS2Keyboard::init(OSDictionary * dict)
     
     // initialize state
     _device                    = 0;
+    _keyState                  = 0;
     _extendCount               = 0;
     _interruptHandlerInstalled = false;
     _ledState                  = 0;
@@ -250,13 +280,28 @@ bool ApplePS2Keyboard::init(OSDictionary * dict)
     _logscancodes = 0;
     _brightnessHack = false;
     
+#ifdef DEBUG
+    // scan code capture is off until requested
+    _scanCodes = 0;
+    _scanCodeHead = 0;
+    _captureScanCodes = false;
+    _replaying = false;
+    _replayEvents[0] = _replayEvents[1] = 0;
+#endif
+    
     // initalize macro translation
     _macroInversion = 0;
     _macroTranslation = 0;
     _macroBuffer = 0;
     _macroCurrent = 0;
+    _macroNodes = 0;
+    _macroEdges = 0;
+    _macroEdgeCount = 0;
+    _macroTerminals = 0;
+    _macroState = 0;
     _macroMax = 0;
     _macroMaxTime = 25000000ULL;
+    nanoseconds_to_absolutetime(_macroMaxTime, &_macroMaxTimeAbs);
     _macroTimer = 0;
 
     // start out with all keys up
@@ -329,13 +374,17 @@ bool ApplePS2Keyboard::init(OSDictionary * dict)
             }
             _macroBuffer = new UInt8[max*kPacketLength];
             _macroMax = max;
+            buildMacroTrie();
         }
     }
     
     // now copy to our PS2ToADBMap -- working copy...
     bcopy(_PS2ToADBMapMapped, _PS2ToADBMap, sizeof(_PS2ToADBMap));
     
-    // populate rest of values via setParamProperties
+    // populate rest of values via setParamProperties (which builds the key
+    // table only if config has keys that change the maps)
+    if (!hasKeyMapKeys(config))
+        buildKeyTable();
     setParamPropertiesGated(config);
     OSSafeReleaseNULL(config);
     
@@ -375,6 +424,28 @@ void ApplePS2Keyboard::free()
         delete[] _macroBuffer;
         _macroBuffer = 0;
     }
+    if (_macroNodes)
+    {
+        delete[] _macroNodes;
+        _macroNodes = 0;
+    }
+    if (_macroEdges)
+    {
+        delete[] _macroEdges;
+        _macroEdges = 0;
+    }
+    if (_macroTerminals)
+    {
+        delete[] _macroTerminals;
+        _macroTerminals = 0;
+    }
+#ifdef DEBUG
+    if (_scanCodes)
+    {
+        delete[] _scanCodes;
+        _scanCodes = 0;
+    }
+#endif
     
     super::free();
 }
@@ -449,6 +520,7 @@ bool ApplePS2Keyboard::start(IOService * provider)
 
     _device = (ApplePS2KeyboardDevice *)provider;
     _device->retain();
+    _keyState = _device->getKeyState();
     
     //
     // Setup workloop with command gate for thread syncronization...
@@ -598,10 +670,10 @@ bool ApplePS2Keyboard::start(IOService * provider)
     _device->lock();
     
     //
-    // Reset and enable the keyboard.
+    // Reset and enable the keyboard (waiting for it, since we hold the lock).
     //
 
-    initKeyboard();
+    initKeyboard(true);
     
     //
     // Install our driver's interrupt handler, for asynchronous data delivery.
@@ -753,6 +825,50 @@ void ApplePS2Keyboard::loadCustomADBMap(OSDictionary* dict, const char* name)
     }
 }
 
+void ApplePS2Keyboard::buildKeyTable()
+{
+    //
+    // Folds _PS2ToPS2Map, _PS2flags and _PS2ToADBMap into one entry per raw
+    // scan code, so the common key path in dispatchKeyboardEventWithPacket
+    // is a single lookup.  Must be rebuilt whenever any of those change.
+    //
+    
+    for (int i = 0; i < countof(_keyTable); i++)
+    {
+        KeyTableEntry& entry = _keyTable[i];
+        entry.keyCode = _PS2ToPS2Map[i];
+        entry.adbKeyCode = _PS2ToADBMap[entry.keyCode];
+        entry.flags = (_PS2flags[i] & kBreaklessKey) | ((_PS2flags[i] >> 8) << kModifierShift);
+        
+        // keys checked by the special cases in dispatchKeyboardEventWithPacket
+        switch (entry.keyCode)
+        {
+            case 0x4e:      // Numpad+
+            case 0x4a:      // Numpad-
+            case 0x0153:    // delete
+            case 0x015f:    // sleep
+            case 0x0128:    // trackpad toggle
+            case 0x0137:    // prt sc/sys rq
+            case 0x0127:    // fnkeys toggle
+                entry.flags |= kSpecialKey;
+                break;
+        }
+        if (entry.keyCode >= 0x01f0 && entry.keyCode <= 0x01ff)  // RKA[0-F]
+            entry.flags |= kSpecialKey;
+        switch (entry.adbKeyCode)
+        {
+            case 0x90:      // brightness
+            case 0x91:
+            case 0x92:      // eject
+                entry.flags |= kSpecialKey;
+                break;
+        }
+        
+        if (0x012a == i)    // header or trailer for PrintScreen
+            entry.flags |= kIgnoredKey;
+    }
+}
+
 OSData** ApplePS2Keyboard::loadMacroData(OSDictionary* dict, const char* name)
 {
     OSData** result = 0;
@@ -827,6 +943,7 @@ void ApplePS2Keyboard::setParamPropertiesGated(OSDictionary * dict)
     if (OSNumber* num = OSDynamicCast(OSNumber, dict->getObject(kMaxMacroTime)))
     {
         _macroMaxTime = num->unsigned64BitValue();
+        nanoseconds_to_absolutetime(_macroMaxTime, &_macroMaxTimeAbs);
         setProperty(kMaxMacroTime, _macroMaxTime, 64);
     }
     
@@ -983,8 +1100,225 @@ void ApplePS2Keyboard::setParamPropertiesGated(OSDictionary * dict)
         parseAction(str->getCStringNoCopy(), _actionSwipeRight, countof(_actionSwipeRight));
         setProperty(kActionSwipeRight, str);
     }
+    
+    // maps may have changed above
+    if (hasKeyMapKeys(dict))
+        buildKeyTable();
+    
+    // interrupt-to-event latency: snapshot, optionally reset
+    if (OSBoolean* reset = OSDynamicCast(OSBoolean, dict->getObject(kResetLatency)))
+    {
+        if (reset->isTrue())
+            _latency.reset();
+        _latency.publish(this);
+    }
+
+    // input statistics: snapshot, optionally reset
+    if (OSBoolean* reset = OSDynamicCast(OSBoolean, dict->getObject(kResetStatistics)))
+    {
+        if (reset->isTrue())
+        {
+            _statistics.reset();
+            _ringBuffer.resetStatistics();
+        }
+        _statistics.publish(this);
+        _ringBuffer.publishStatistics(this);
+    }
+    
+#ifdef DEBUG
+    // scan code capture: start/stop (either way the last snapshot is removed)
+    if (OSBoolean* capture = OSDynamicCast(OSBoolean, dict->getObject(kCaptureScanCodes)))
+    {
+        if (capture->isTrue())
+        {
+            _captureScanCodes = false;
+            if (!_scanCodes)
+            {
+                // only time and data are written per entry, reserved stays zero
+                _scanCodes = new ScanCodeEntry[kScanCodeCaptureSize];
+                if (_scanCodes)
+                    bzero(_scanCodes, kScanCodeCaptureSize * sizeof(ScanCodeEntry));
+            }
+            __atomic_store_n(&_scanCodeHead, 0, __ATOMIC_RELEASE);
+            _captureScanCodes = (NULL != _scanCodes);
+        }
+        else
+            _captureScanCodes = false;
+        removeProperty(kScanCodeCapture);
+        setProperty(kCaptureScanCodes, _captureScanCodes);
+    }
+    
+    // scan code capture: snapshot for user space
+    if (dict->getObject(kScanCodeCapture))
+        publishScanCodeCapture();
+    
+    // replay of a capture through the keyboard path (see replayScanCodes)
+    if (OSData* data = OSDynamicCast(OSData, dict->getObject(kReplayScanCodes)))
+        replayScanCodes(data);
+#endif
 }
 
+#ifdef DEBUG
+void ApplePS2Keyboard::publishScanCodeCapture()
+{
+    //
+    // Publishes the captured scan codes, oldest first, as an array of
+    // ScanCodeEntry with times in nanoseconds relative to the first entry.
+    // This is also the format accepted by ReplayScanCodes.
+    //
+    
+    if (!_scanCodes)
+        return;
+    
+    UInt32 head = __atomic_load_n(&_scanCodeHead, __ATOMIC_ACQUIRE);
+    UInt32 count = head < kScanCodeCaptureSize ? head : kScanCodeCaptureSize;
+    OSData* data = OSData::withCapacity(count * sizeof(ScanCodeEntry));
+    if (!data)
+        return;
+    uint64_t first = 0;
+    for (UInt32 i = head - count; i != head; i++)
+    {
+        ScanCodeEntry entry = _scanCodes[i & (kScanCodeCaptureSize-1)];
+        if (i == head - count)
+            first = entry.time;
+        absolutetime_to_nanoseconds(entry.time - first, &entry.time);
+        data->appendBytes(&entry, sizeof(entry));
+    }
+    setProperty(kScanCodeCapture, data);
+    data->release();
+}
+
+void ApplePS2Keyboard::replayScanCodes(OSData* data)
+{
+    //
+    // Feeds a capture (see publishScanCodeCapture) through the keyboard path
+    // exactly as interruptOccurred/packetReady would: extend handling, the
+    // key bit vector, PS2 to PS2 map, macro inversion and ADB mapping.  The
+    // captured spacing between bytes is kept, so macro timing is reproduced.
+    // Key events are counted, not sent to the HID system, and key side effects
+    // (sleep/eject, touchpad toggle, HIDFKeyMode, ACPI RKAx, brightness and
+    // the key state shared with the trackpad) are skipped.
+    //
+    // The live interrupt action is removed for the duration, and the replay
+    // starts with no keys down and no macro in progress; the live key and
+    // macro state is restored afterwards.
+    //
+    
+    if (!_device || !_interruptHandlerInstalled)
+        return;
+    
+    // the replay gets its own macro buffer, a live partial macro stays in the other
+    UInt8* macroBuffer = _macroBuffer;
+    if (macroBuffer)
+    {
+        _macroBuffer = new UInt8[_macroMax*kPacketLength];
+        if (!_macroBuffer)
+        {
+            _macroBuffer = macroBuffer;
+            return;
+        }
+    }
+    int macroCurrent = _macroCurrent;
+    UInt16 macroState = _macroState;
+    _macroCurrent = 0;
+    _macroState = 0;
+    
+    const ScanCodeEntry* entries = static_cast<const ScanCodeEntry*>(data->getBytesNoCopy());
+    unsigned count = data->getLength() / sizeof(ScanCodeEntry);
+    
+    _device->uninstallInterruptAction();
+    _ringBuffer.reset();
+    UInt32 keyBitVector[KBV_NUNITS];
+    memcpy(keyBitVector, _keyBitVector, sizeof(keyBitVector));
+    bzero(_keyBitVector, sizeof(_keyBitVector));
+    UInt8 extendCount = _extendCount;
+    UInt16 modifierState = _PS2modifierState;
+    PS2KeyState keyState;
+    readKeyState(_keyState, &keyState);
+    _extendCount = 0;
+    _PS2modifierState = 0;
+    _replaying = true;
+    _replayEvents[0] = _replayEvents[1] = 0;
+    
+    unsigned packets = 0;
+    uint64_t start_abs, end_abs, elapsed_ns;
+    clock_get_uptime(&start_abs);
+    for (unsigned i = 0; i < count; i++)
+    {
+        uint64_t offset;
+        nanoseconds_to_absolutetime(entries[i].time, &offset);
+        if (kPS2IR_packetReady == processScanCode(entries[i].data, start_abs + offset))
+        {
+            packets++;
+            packetReady();
+        }
+    }
+    // a partial macro at the end is sent as is
+    if (_macroCurrent)
+        dispatchInvertBuffer();
+    clock_get_uptime(&end_abs);
+    absolutetime_to_nanoseconds(end_abs - start_abs, &elapsed_ns);
+    
+    // keys the capture left down (missed break codes)
+    unsigned stuck = 0;
+    for (int i = 0; i < KBV_NUNITS; i++)
+        stuck += __builtin_popcount(_keyBitVector[i]);
+    
+    _replaying = false;
+    if (macroBuffer)
+    {
+        delete[] _macroBuffer;
+        _macroBuffer = macroBuffer;
+    }
+    _macroCurrent = macroCurrent;
+    _macroState = macroState;
+    if (_macroTimer)
+    {
+        cancelTimer(_macroTimer);
+        if (_macroCurrent)
+            setTimerTimeout(_macroTimer, _macroMaxTimeAbs);
+    }
+    memcpy(_keyBitVector, keyBitVector, sizeof(_keyBitVector));
+    _extendCount = extendCount;
+    _PS2modifierState = modifierState;
+    beginKeyStateUpdate(_keyState);
+    _keyState->keyCount = keyState.keyCount;
+    _keyState->time = keyState.time;
+    _keyState->modifiers = keyState.modifiers;
+    endKeyStateUpdate(_keyState);
+    _ringBuffer.reset();
+    _device->installInterruptAction(this,
+        OSMemberFunctionCast(PS2InterruptAction, this, &ApplePS2Keyboard::interruptOccurred),
+        OSMemberFunctionCast(PS2PacketAction,this,&ApplePS2Keyboard::packetReady));
+    
+    IOLog("%s: replayed %u scan codes, %u packets in %lld ns, %lld down %lld up, %u stuck\n", getName(), count, packets, elapsed_ns, _replayEvents[1], _replayEvents[0], stuck);
+    
+    // publish results for ioreg
+    if (OSDictionary* results = OSDictionary::withCapacity(7))
+    {
+        const struct {const char* name; uint64_t value;} values[]={
+            {"ScanCodes",                   count},
+            {"Packets",                     packets},
+            {"ElapsedNS",                   elapsed_ns},
+            {"NSPerPacket",                 packets ? elapsed_ns / packets : 0},
+            {"KeyDowns",                    _replayEvents[1]},
+            {"KeyUps",                      _replayEvents[0]},
+            {"StuckKeys",                   stuck},
+        };
+        for (int i = 0; i < countof(values); i++)
+        {
+            if (OSNumber* num = OSNumber::withNumber(values[i].value, 64))
+            {
+                results->setObject(values[i].name, num);
+                num->release();
+            }
+        }
+        setProperty(kReplayResults, results);
+        results->release();
+    }
+}
+#endif
+
 IOReturn ApplePS2Keyboard::setParamProperties(OSDictionary *dict)
 {
     ////IOReturn result = super::setParamProperties(dict);
@@ -1160,7 +1494,7 @@ IOReturn ApplePS2Keyboard::message(UInt32 type, IOService* provider, void* argum
 
 // - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
 
-PS2InterruptResult ApplePS2Keyboard::interruptOccurred(UInt8 data)   // PS2InterruptAction
+PS2InterruptResult ApplePS2Keyboard::interruptOccurred(UInt8 scanCode)   // PS2InterruptAction
 {
     ////IOLog("ps2interrupt: scanCode = %02x\n", data);
     ////uint64_t time;
@@ -1173,18 +1507,40 @@ PS2InterruptResult ApplePS2Keyboard::interruptOccurred(UInt8 data)   // PS2Inter
     // NOT send any BLOCKING commands to our device in this context.
     //
     
+    uint64_t now_abs;
+    clock_get_uptime(&now_abs);
+    
+#ifdef DEBUG
+    // record raw byte for offline diagnosis (see publishScanCodeCapture)
+    if (_captureScanCodes)
+    {
+        UInt32 head = _scanCodeHead;
+        ScanCodeEntry& entry = _scanCodes[head & (kScanCodeCaptureSize-1)];
+        entry.time = now_abs;
+        entry.data = scanCode;
+        __atomic_store_n(&_scanCodeHead, head + 1, __ATOMIC_RELEASE);
+    }
+#endif
+    
+    return processScanCode(scanCode, now_abs);
+}
+
+PS2InterruptResult ApplePS2Keyboard::processScanCode(UInt8 data, uint64_t now_abs)
+{
+    _statistics.count(InputStatistics::kBytes);
     UInt8* packet = _ringBuffer.head();
     
     // special case for $AA $00, spontaneous reset (usually due to static electricity)
     if (kSC_Reset == _lastdata && 0x00 == data)
     {
         IOLog("%s: Unexpected reset (%02x %02x) request from PS/2 controller.\n", getName(), _lastdata, data);
+        _statistics.count(InputStatistics::kResets);
         
         // buffer a packet that will cause a reset in work loop
         packet[0] = 0x00;
         packet[1] = kSC_Reset;
         // mark packet with timestamp
-        clock_get_uptime((uint64_t*)(&packet[kPacketTimeOffset]));
+        *(uint64_t*)(&packet[kPacketTimeOffset]) = now_abs;
         _ringBuffer.advanceHead(kPacketLength);
         _extendCount = 0;
         return kPS2IR_packetReady;
@@ -1195,11 +1551,13 @@ PS2InterruptResult ApplePS2Keyboard::interruptOccurred(UInt8 data)   // PS2Inter
     if (kSC_Acknowledge == data)
     {
         IOLog("%s: Unexpected acknowledge (%02x) from PS/2 controller.\n", getName(), data);
+        _statistics.count(InputStatistics::kRejects);
         return kPS2IR_packetBuffering;
     }
     if (kSC_Resend == data)
     {
         IOLog("%s: Unexpected resend (%02x) request from PS/2 controller.\n", getName(), data);
+        _statistics.count(InputStatistics::kRejects);
         return kPS2IR_packetBuffering;
     }
     
@@ -1267,7 +1625,7 @@ PS2InterruptResult ApplePS2Keyboard::interruptOccurred(UInt8 data)   // PS2Inter
         packet[0] = extended + 1;  // packet[0] = 0 is special packet, so add one
         packet[1] = data;
         // mark packet with timestamp
-        clock_get_uptime((uint64_t*)(&packet[kPacketTimeOffset]));
+        *(uint64_t*)(&packet[kPacketTimeOffset]) = now_abs;
         _ringBuffer.advanceHead(kPacketLength);
         return kPS2IR_packetReady;
     }
@@ -1283,10 +1641,12 @@ void ApplePS2Keyboard::packetReady()
         UInt8* packet = _ringBuffer.tail();
         if (0x00 != packet[0])
         {
+            _statistics.count(InputStatistics::kPackets);
             if (!_macroInversion || !invertMacros(packet))
             {
                 // normal packet
                 dispatchKeyboardEventWithPacket(packet);
+                _latency.addSince(*(uint64_t*)(&packet[kPacketTimeOffset]), this);
             }
         }
         else
@@ -1296,18 +1656,133 @@ void ApplePS2Keyboard::packetReady()
         }
         _ringBuffer.advanceTail(kPacketLength);
     }
+    _ringBuffer.publishStatistics(this);
+    _statistics.update(this);
 }
 
-bool ApplePS2Keyboard::compareMacro(const UInt8* buffer, const UInt8* data, int count)
+void ApplePS2Keyboard::buildMacroTrie()
 {
-    while (count--)
+    //
+    // Compiles _macroInversion into a trie, so invertMacros only has to follow
+    // one edge per packet instead of comparing the buffered packets against
+    // every macro.
+    //
+    // The linear matcher took the first macro (in plist order) that either
+    // matched exactly with the right modifiers, or was longer and matched so
+    // far.  To keep that, a node only lists the macros ending there that come
+    // before its first longer macro, in order.
+    //
+    // If the trie cannot be built, invertMacros falls back to the linear
+    // matcher (see invertMacrosLinear).
+    //
+    
+    assert(_macroInversion);
+    
+    int count = 0, keys = 0;
+    for (OSData** p = _macroInversion; *p; p++)
     {
-        if (buffer[0] != data[0] || buffer[1] != data[1])
-            return false;
-        buffer += kPacketLength;
-        data += kPacketKeyDataLength;
+        count++;
+        keys += ((*p)->getLength()-kPrefixBytes) / kPacketKeyDataLength;
     }
-    return true;
+    if (count >= kMacroNoContinuation || keys >= 0xFFFF)
+    {
+        IOLog("%s: %d macro inversions (%d keys) are too many for a trie, using linear matching\n", getName(), count, keys);
+        return;
+    }
+    
+    _macroNodes = new MacroTrieNode[keys+1];
+    _macroEdges = new MacroTrieEdge[keys];
+    _macroTerminals = new UInt16[count];
+    UInt16* ends = new UInt16[count];
+    if (!_macroNodes || !_macroEdges || !_macroTerminals || !ends)
+    {
+        if (ends)
+            delete[] ends;
+        if (_macroNodes)
+            delete[] _macroNodes;
+        if (_macroEdges)
+            delete[] _macroEdges;
+        if (_macroTerminals)
+            delete[] _macroTerminals;
+        _macroNodes = 0;
+        _macroEdges = 0;
+        _macroTerminals = 0;
+        IOLog("%s: no memory for macro inversion trie, using linear matching\n", getName());
+        return;
+    }
+    
+    int nodes = 1;
+    _macroNodes[0].continuation = kMacroNoContinuation;
+    _macroEdgeCount = 0;
+    
+    // insert every sequence, remembering where each one ends
+    for (int i = 0; i < count; i++)
+    {
+        const UInt8* data = static_cast<const UInt8*>(_macroInversion[i]->getBytesNoCopy());
+        int length = (_macroInversion[i]->getLength()-kPrefixBytes) / kPacketKeyDataLength;
+        data += kSequenceBytesOffset;
+        UInt16 node = 0;
+        for (int j = 0; j < length; j++, data += kPacketKeyDataLength)
+        {
+            if (kMacroNoContinuation == _macroNodes[node].continuation && node != 0)
+                _macroNodes[node].continuation = i;
+            UInt32 match = (static_cast<UInt32>(node) << 16) | (data[0] << 8) | data[1];
+            int edge = findMacroEdge(match);
+            if (edge < 0)
+            {
+                // new node, keep edges sorted
+                int k = _macroEdgeCount++;
+                for (; k > 0 && _macroEdges[k-1].match > match; k--)
+                    _macroEdges[k] = _macroEdges[k-1];
+                _macroEdges[k].match = match;
+                _macroEdges[k].child = nodes;
+                _macroNodes[nodes].continuation = kMacroNoContinuation;
+                node = nodes++;
+            }
+            else
+                node = _macroEdges[edge].child;
+        }
+        ends[i] = node;
+    }
+    
+    // lay out each node's exact matches contiguously, in plist order
+    for (int n = 0; n < nodes; n++)
+        _macroNodes[n].terminalCount = 0;
+    for (int i = 0; i < count; i++)
+        if (i < _macroNodes[ends[i]].continuation)
+            _macroNodes[ends[i]].terminalCount++;
+    int start = 0;
+    for (int n = 0; n < nodes; n++)
+    {
+        _macroNodes[n].terminalStart = start;
+        start += _macroNodes[n].terminalCount;
+        _macroNodes[n].terminalCount = 0;
+    }
+    for (int i = 0; i < count; i++)
+    {
+        MacroTrieNode& node = _macroNodes[ends[i]];
+        if (i < node.continuation)
+            _macroTerminals[node.terminalStart + node.terminalCount++] = i;
+    }
+    delete[] ends;
+    
+    DEBUG_LOG("%s: %d macro inversions compiled into %d nodes\n", getName(), count, nodes);
+}
+
+int ApplePS2Keyboard::findMacroEdge(UInt32 match)
+{
+    int low = 0, high = _macroEdgeCount - 1;
+    while (low <= high)
+    {
+        int mid = (low + high) / 2;
+        if (_macroEdges[mid].match == match)
+            return mid;
+        if (_macroEdges[mid].match < match)
+            low = mid + 1;
+        else
+            high = mid - 1;
+    }
+    return -1;
 }
 
 bool ApplePS2Keyboard::invertMacros(const UInt8* packet)
@@ -1320,21 +1795,81 @@ bool ApplePS2Keyboard::invertMacros(const UInt8* packet)
     if (_macroCurrent > 0)
     {
         // cancel macro conversion if packet arrives too late
-        uint64_t now_ns;
-        absolutetime_to_nanoseconds(*(uint64_t*)(&packet[kPacketTimeOffset]), &now_ns);
-        uint64_t prev;
-        absolutetime_to_nanoseconds(*(uint64_t*)(&_macroBuffer[(_macroCurrent-1)*kPacketLength+kPacketTimeOffset]), &prev);
-        if (now_ns-prev > _macroMaxTime)
+        uint64_t now_abs = *(uint64_t*)(&packet[kPacketTimeOffset]);
+        uint64_t prev = *(uint64_t*)(&_macroBuffer[(_macroCurrent-1)*kPacketLength+kPacketTimeOffset]);
+        if (now_abs-prev > _macroMaxTimeAbs)
             dispatchInvertBuffer();
 #if 0 // for testing min/max between macro segments
-        uint64_t diff = now_ns-prev;
+        uint64_t diff = now_abs-prev;
         static uint64_t diffmin = UINT64_MAX, diffmax = 0;
         if (diff > diffmax) diffmax = diff;
         if (diff < diffmin) diffmin = diff;
         IOLog("diffmin=%lld, diffmax=%lld\n", diffmin, diffmax);
 #endif
     }
+    
+    if (!_macroNodes)
+        return invertMacrosLinear(packet);
  
+    // follow the current packet from the sequence buffered so far
+    UInt32 match = (static_cast<UInt32>(_macroState) << 16) | (packet[0] << 8) | packet[1];
+    int edge = findMacroEdge(match);
+    if (edge >= 0)
+    {
+        // add current packet to macro buffer
+        memcpy(_macroBuffer+_macroCurrent*kPacketLength, packet, kPacketLength);
+        const MacroTrieNode& node = _macroNodes[_macroEdges[edge].child];
+        for (int i = 0; i < node.terminalCount; i++)
+        {
+            const UInt8* data = static_cast<const UInt8*>(_macroInversion[_macroTerminals[node.terminalStart+i]]->getBytesNoCopy());
+            // get modifier mask/compare from macro definition
+            UInt16 mask = (static_cast<UInt16>(data[kModifierBytesOffset+0]) << 8) + data[kModifierBytesOffset+1];
+            UInt16 compare = (static_cast<UInt16>(data[kModifierBytesOffset+2]) << 8) + data[kModifierBytesOffset+3];
+            if ((0xFFFF == compare && (_PS2modifierState & mask)) || ((_PS2modifierState & mask) == compare))
+            {
+                // exact match causes macro inversion
+                // grab bytes from macro definition
+                _macroBuffer[0] = data[kOutputBytesOffset+0];
+                _macroBuffer[1] = data[kOutputBytesOffset+1];
+                // dispatch constructed packet (timestamp is stamp on first macro packet)
+                dispatchKeyboardEventWithPacket(_macroBuffer);
+                cancelTimer(_macroTimer);
+                _macroCurrent = 0;
+                _macroState = 0;
+                return true;
+            }
+        }
+        if (kMacroNoContinuation != node.continuation)
+        {
+            // partial match, keep waiting for full match
+            cancelTimer(_macroTimer);
+            setTimerTimeout(_macroTimer, _macroMaxTimeAbs);
+            _macroCurrent++;
+            _macroState = _macroEdges[edge].child;
+            return true;
+        }
+    }
+    // no match, so... empty macro buffer that may have been existing...
+    if (_macroCurrent > 0)
+        dispatchInvertBuffer();
+    
+    return false;
+}
+
+bool ApplePS2Keyboard::compareMacro(const UInt8* buffer, const UInt8* data, int count)
+{
+    while (count--)
+    {
+        if (buffer[0] != data[0] || buffer[1] != data[1])
+            return false;
+        buffer += kPacketLength;
+        data += kPacketKeyDataLength;
+    }
+    return true;
+}
+
+bool ApplePS2Keyboard::invertMacrosLinear(const UInt8* packet)
+{
     // add current packet to macro buffer for comparison
     memcpy(_macroBuffer+_macroCurrent*kPacketLength, packet, kPacketLength);
     int buffered = _macroCurrent+1;
@@ -1370,7 +1905,7 @@ bool ApplePS2Keyboard::invertMacros(const UInt8* packet)
                 {
                     // partial match, keep waiting for full match
                     cancelTimer(_macroTimer);
-                    setTimerTimeout(_macroTimer, _macroMaxTime);
+                    setTimerTimeout(_macroTimer, _macroMaxTimeAbs);
                     _macroCurrent++;
                     return true;
                 }
@@ -1398,12 +1933,10 @@ void ApplePS2Keyboard::onMacroTimer()
     // after all packets have been processed, ok to check for time expiration
     if (_macroCurrent > 0)
     {
-        uint64_t now_abs, now_ns;
+        uint64_t now_abs;
         clock_get_uptime(&now_abs);
-        absolutetime_to_nanoseconds(now_abs, &now_ns);
-        uint64_t prev;
-        absolutetime_to_nanoseconds(*(uint64_t*)(&_macroBuffer[(_macroCurrent-1)*kPacketLength+kPacketTimeOffset]), &prev);
-        if (now_ns-prev > _macroMaxTime)
+        uint64_t prev = *(uint64_t*)(&_macroBuffer[(_macroCurrent-1)*kPacketLength+kPacketTimeOffset]);
+        if (now_abs-prev > _macroMaxTimeAbs)
             dispatchInvertBuffer();
     }
 }
@@ -1418,6 +1951,7 @@ void ApplePS2Keyboard::dispatchInvertBuffer()
         packet += kPacketLength;
     }
     _macroCurrent = 0;
+    _macroState = 0;
     cancelTimer(_macroTimer);
 }
 
@@ -1561,6 +2095,53 @@ void ApplePS2Keyboard::onSleepEjectTimer()
     }
 }
 
+void ApplePS2Keyboard::publishKeyState(UInt16 adbKeyCode, bool goingDown, uint64_t now_abs)
+{
+    // allow mouse/trackpad driver to have time of last keyboard activity
+    // used to implement "PalmNoAction When Typing" and "OutsizeZoneNoAction When Typing"
+    static const UInt32 masks[] =
+    {
+        0x10,       // 0x36
+        0x100000,   // 0x37
+        0,          // 0x38
+        0,          // 0x39
+        0x080000,   // 0x3a
+        0x040000,   // 0x3b
+        0,          // 0x3c
+        0x08,       // 0x3d
+        0x04,       // 0x3e
+        0x200000,   // 0x3f
+    };
+    
+    beginKeyStateUpdate(_keyState);
+    switch (adbKeyCode)
+    {
+        // don't store key time for modifier keys going down
+        case 0x38:  // left shift
+        case 0x3c:  // right shift
+        case 0x3b:  // left control
+        case 0x3e:  // right control
+        case 0x3a:  // left windows (option)
+        case 0x3d:  // right windows
+        case 0x37:  // left alt (command)
+        case 0x36:  // right alt
+        case 0x3f:  // osx fn (function)
+            if (goingDown)
+            {
+                _keyState->modifiers |= masks[adbKeyCode-0x36];
+                break;
+            }
+            _keyState->modifiers &= ~masks[adbKeyCode-0x36];
+            _keyState->time = now_abs;
+            break;
+            
+        default:
+            ++_keyState->keyCount;  // keys cancel momentum scroll
+            _keyState->time = now_abs;
+    }
+    endKeyStateUpdate(_keyState);
+}
+
 bool ApplePS2Keyboard::dispatchKeyboardEventWithPacket(const UInt8* packet)
 {
     // Parses the given scan code, updating all necessary internal state, and
@@ -1579,8 +2160,6 @@ bool ApplePS2Keyboard::dispatchKeyboardEventWithPacket(const UInt8* packet)
     bool goingDown = !(scanCode & kSC_UpBit);
     unsigned keyCode;
     uint64_t now_abs = *(uint64_t*)(&packet[kPacketTimeOffset]);
-    uint64_t now_ns;
-    absolutetime_to_nanoseconds(now_abs, &now_ns);
 
     //
     // Convert the scan code into a key code index.
@@ -1603,165 +2182,202 @@ bool ApplePS2Keyboard::dispatchKeyboardEventWithPacket(const UInt8* packet)
             dispatchKeyboardEventX(_PS2ToADBMap[scanCode], false, now_abs);
             return true;
         }
-        
-        // Allow PS2 -> PS2 map to work, look in normal part of the table
-        keyCode = _PS2ToPS2Map[keyCodeRaw];
-        
-#ifdef DEBUG_VERBOSE
-        if (keyCode != keyCodeRaw)
-            DEBUG_LOG("%s: keycode translated from=0x%02x to=0x%04x\n", getName(), keyCodeRaw, keyCode);
-#endif
     }
     else
     {
-        // allow PS2 -> PS2 map to work, look in extended part of the table
+        // extended part of the table
         keyCodeRaw += KBV_NUM_SCANCODES;
-        keyCode = _PS2ToPS2Map[keyCodeRaw];
-        
+    }
+    
+    // PS2 -> PS2 map, flags and PS2 -> ADB map in one (see buildKeyTable)
+    const KeyTableEntry entry = _keyTable[keyCodeRaw];
+    keyCode = entry.keyCode;
+    UInt8 adbKeyCode = entry.adbKeyCode;
+    bool eatKey = false;
+    
 #ifdef DEBUG_VERBOSE
-        if (keyCode != keyCodeRaw)
-            DEBUG_LOG("%s: keycode translated from=0xe0%02x to=0x%04x\n", getName(), keyCodeRaw, keyCode);
+    if (keyCode != keyCodeRaw)
+        DEBUG_LOG("%s: keycode translated from=0x%04x to=0x%04x\n", getName(), keyCodeRaw, keyCode);
 #endif
-        // handle special cases
-        switch (keyCodeRaw)
-        {
-            case 0x012a: // header or trailer for PrintScreen
-                return false;
-        }
-    }
+    
+    if (entry.flags & kIgnoredKey)
+        return false;
     
     // tracking modifier key state
-    if (UInt8 bit = (_PS2flags[keyCodeRaw] >> 8))
+    if (UInt8 bit = (entry.flags >> kModifierShift))
     {
         UInt16 mask = 1 << (bit-1);
         goingDown ? _PS2modifierState |= mask : _PS2modifierState &= ~mask;
     }
-
-    // codes e0f0 through e0ff can be used to call back into ACPI methods on this device
-    if (keyCode >= 0x01f0 && keyCode <= 0x01ff && _provider != NULL)
+    
+    if (entry.flags & kSpecialKey)
     {
-        // evaluate RKA[0-F] for these keys
-        char method[5] = "RKAx";
-        char n = keyCode - 0x01f0;
-        method[3] = n < 10 ? n + '0' : n - 10 + 'A';
-        if (OSNumber* num = OSNumber::withNumber(goingDown, 32))
+        // codes e0f0 through e0ff can be used to call back into ACPI methods on this device
+        // (side effects like this one are skipped while replaying a capture)
+        if (keyCode >= 0x01f0 && keyCode <= 0x01ff && _provider != NULL && !replaying())
         {
-            // call ACPI RKAx(Arg0=goingDown)
-            _provider->evaluateObject(method, NULL, (OSObject**)&num, 1);
-            num->release();
+            // evaluate RKA[0-F] for these keys
+            char method[5] = "RKAx";
+            char n = keyCode - 0x01f0;
+            method[3] = n < 10 ? n + '0' : n - 10 + 'A';
+            if (OSNumber* num = OSNumber::withNumber(goingDown, 32))
+            {
+                // call ACPI RKAx(Arg0=goingDown)
+                _provider->evaluateObject(method, NULL, (OSObject**)&num, 1);
+                num->release();
+            }
         }
-    }
 
-    // handle special cases
-    switch (keyCode)
-    {
-        case 0x4e:  // Numpad+
-        case 0x4a:  // Numpad-
-            if (_backlightLevels && checkModifierState(kMaskLeftControl|kMaskLeftAlt))
-            {
-                // Ctrl+Alt+Numpad(+/-) => use to manipulate keyboard backlight
-                modifyKeyboardBacklight(keyCode, goingDown);
+        // handle special cases
+        switch (keyCode)
+        {
+            case 0x4e:  // Numpad+
+            case 0x4a:  // Numpad-
+                if (_backlightLevels && checkModifierState(kMaskLeftControl|kMaskLeftAlt))
+                {
+                    // Ctrl+Alt+Numpad(+/-) => use to manipulate keyboard backlight
+                    if (!replaying())
+                        modifyKeyboardBacklight(keyCode, goingDown);
+                    keyCode = 0;
+                }
+                else if (_brightnessHack && checkModifierState(kMaskLeftControl|kMaskLeftShift))
+                {
+                    // Ctrl+Shift+NumPad(+/0) => manipulate brightness (special hack for HP Envy)
+                    // Fn+F2 generates e0 ab and so does Fn+F3 (we will null those out in ps2 map)
+                    static unsigned keys[] = { 0x2a, 0x1d };
+                    // if Option key is down don't pull up on the Shift keys
+                    int start = checkModifierState(kMaskLeftWindows) ? 1 : 0;
+                    for (int i = start; i < countof(keys); i++)
+                        if (KBV_IS_KEYDOWN(keys[i]))
+                            dispatchKeyboardEventX(_PS2ToADBMap[keys[i]], false, now_abs);
+                    dispatchKeyboardEventX(keyCode == 0x4e ? 0x90 : 0x91, goingDown, now_abs);
+                    for (int i = start; i < countof(keys); i++)
+                        if (KBV_IS_KEYDOWN(keys[i]))
+                            dispatchKeyboardEventX(_PS2ToADBMap[keys[i]], true, now_abs);
+                    keyCode = 0;
+                }
+                break;
+            
+            case 0x0153:    // delete
+                // check for Ctrl+Alt+Delete? (three finger salute)
+                if (checkModifierState(kMaskLeftControl|kMaskLeftAlt))
+                {
+                    keyCode = 0;
+                    if (!goingDown)
+                    {
+                        // Note: If OS X thinks the Command and Control keys are down at the time of
+                        //  receiving an ADB 0x7f (power button), it will unconditionaly and unsafely
+                        //  reboot the computer, much like the old PC/AT Ctrl+Alt+Delete!
+                        // That's why we make sure Control (0x3b) and Alt (0x37) are up!!
+                        dispatchKeyboardEventX(0x37, false, now_abs);
+                        dispatchKeyboardEventX(0x3b, false, now_abs);
+                        dispatchKeyboardEventX(0x7f, true, now_abs);
+                        dispatchKeyboardEventX(0x7f, false, now_abs);
+                    }
+                }
+                break;
+                
+            case 0x015f:    // sleep
                 keyCode = 0;
-            }
-            else if (_brightnessHack && checkModifierState(kMaskLeftControl|kMaskLeftShift))
+                if (replaying())
+                    break;
+                if (goingDown)
+                {
+                    _timerFunc = kTimerSleep;
+                    if (_fkeymode || !_maxsleeppresstime)
+                        onSleepEjectTimer();
+                    else
+                        setTimerTimeout(_sleepEjectTimer, (uint64_t)_maxsleeppresstime * 1000000);
+                }
+                else
+                {
+                    cancelTimer(_sleepEjectTimer);
+                }
+                break;
+
+            //REVIEW: this is getting a bit ugly
+            case 0x0128:    // alternate that cannot fnkeys toggle (discrete trackpad toggle)
+            case 0x0137:    // prt sc/sys rq
             {
-                // Ctrl+Shift+NumPad(+/0) => manipulate brightness (special hack for HP Envy)
-                // Fn+F2 generates e0 ab and so does Fn+F3 (we will null those out in ps2 map)
-                static unsigned keys[] = { 0x2a, 0x1d };
-                // if Option key is down don't pull up on the Shift keys
-                int start = checkModifierState(kMaskLeftWindows) ? 1 : 0;
-                for (int i = start; i < countof(keys); i++)
-                    if (KBV_IS_KEYDOWN(keys[i]))
-                        dispatchKeyboardEventX(_PS2ToADBMap[keys[i]], false, now_abs);
-                dispatchKeyboardEventX(keyCode == 0x4e ? 0x90 : 0x91, goingDown, now_abs);
-                for (int i = start; i < countof(keys); i++)
-                    if (KBV_IS_KEYDOWN(keys[i]))
-                        dispatchKeyboardEventX(_PS2ToADBMap[keys[i]], true, now_abs);
+                unsigned origKeyCode = keyCode;
                 keyCode = 0;
+                if (!goingDown || replaying())
+                    break;
+                if (!checkModifierState(kMaskLeftControl))
+                {
+                    // get current enabled status, and toggle it
+                    bool enabled;
+                    _device->dispatchMouseMessage(kPS2M_getDisableTouchpad, &enabled);
+                    enabled = !enabled;
+                    _device->dispatchMouseMessage(kPS2M_setDisableTouchpad, &enabled);
+                    break;
+                }
+                if (origKeyCode != 0x0137)
+                    break; // do not fall through for 0x0128
+                // fall through
             }
-            break;
-            
-        case 0x0153:    // delete
-            // check for Ctrl+Alt+Delete? (three finger salute)
-            if (checkModifierState(kMaskLeftControl|kMaskLeftAlt))
-            {
+            case 0x0127:    // alternate for fnkeys toggle (discrete fnkeys toggle)
                 keyCode = 0;
                 if (!goingDown)
+                    break;
+                if (_fkeymodesupported && !replaying())
                 {
-                    // Note: If OS X thinks the Command and Control keys are down at the time of
-                    //  receiving an ADB 0x7f (power button), it will unconditionaly and unsafely
-                    //  reboot the computer, much like the old PC/AT Ctrl+Alt+Delete!
-                    // That's why we make sure Control (0x3b) and Alt (0x37) are up!!
-                    dispatchKeyboardEventX(0x37, false, now_abs);
-                    dispatchKeyboardEventX(0x3b, false, now_abs);
-                    dispatchKeyboardEventX(0x7f, true, now_abs);
-                    dispatchKeyboardEventX(0x7f, false, now_abs);
+                    // modify HIDFKeyMode via IOService... IOHIDSystem
+                    if (IOService* service = IOService::waitForMatchingService(serviceMatching(kIOHIDSystem), 0))
+                    {
+                        const OSObject* num = OSNumber::withNumber(!_fkeymode, 32);
+                        const OSString* key = OSString::withCString(kHIDFKeyMode);
+                        if (num && key)
+                        {
+                            if (OSDictionary* dict = OSDictionary::withObjects(&num, &key, 1))
+                            {
+                                service->setProperties(dict);
+                                dict->release();
+                            }
+                        }
+                        OSSafeReleaseNULL(num);
+                        OSSafeReleaseNULL(key);
+                        service->release();
+                    }
                 }
-            }
-            break;
-                
-        case 0x015f:    // sleep
-            keyCode = 0;
-            if (goingDown)
-            {
-                _timerFunc = kTimerSleep;
-                if (_fkeymode || !_maxsleeppresstime)
-                    onSleepEjectTimer();
-                else
-                    setTimerTimeout(_sleepEjectTimer, (uint64_t)_maxsleeppresstime * 1000000);
-            }
-            else
-            {
-                cancelTimer(_sleepEjectTimer);
-            }
-            break;
-
-        //REVIEW: this is getting a bit ugly
-        case 0x0128:    // alternate that cannot fnkeys toggle (discrete trackpad toggle)
-        case 0x0137:    // prt sc/sys rq
-        {
-            unsigned origKeyCode = keyCode;
-            keyCode = 0;
-            if (!goingDown)
-                break;
-            if (!checkModifierState(kMaskLeftControl))
-            {
-                // get current enabled status, and toggle it
-                bool enabled;
-                _device->dispatchMouseMessage(kPS2M_getDisableTouchpad, &enabled);
-                enabled = !enabled;
-                _device->dispatchMouseMessage(kPS2M_setDisableTouchpad, &enabled);
                 break;
-            }
-            if (origKeyCode != 0x0137)
-                break; // do not fall through for 0x0128
-            // fall through
         }
-        case 0x0127:    // alternate for fnkeys toggle (discrete fnkeys toggle)
-            keyCode = 0;
-            if (!goingDown)
+
+        // map scan code to Apple code, unless the key was eaten above
+        if (keyCode != entry.keyCode)
+            adbKeyCode = _PS2ToADBMap[keyCode];
+    
+        // special cases
+        switch (adbKeyCode)
+        {
+            case 0x90:
+            case 0x91:
+                if (_brightnessLevels)
+                {
+                    if (!replaying())
+                        modifyScreenBrightness(adbKeyCode, goingDown);
+                    adbKeyCode = DEADKEY;
+                }
                 break;
-            if (_fkeymodesupported)
-            {
-                // modify HIDFKeyMode via IOService... IOHIDSystem
-                if (IOService* service = IOService::waitForMatchingService(serviceMatching(kIOHIDSystem), 0))
+            case 0x92: // eject
+                if (0 == _PS2modifierState && !replaying())
                 {
-                    const OSObject* num = OSNumber::withNumber(!_fkeymode, 32);
-                    const OSString* key = OSString::withCString(kHIDFKeyMode);
-                    if (num && key)
+                    if (goingDown)
                     {
-                        if (OSDictionary* dict = OSDictionary::withObjects(&num, &key, 1))
-                        {
-                            service->setProperties(dict);
-                            dict->release();
-                        }
+                        eatKey = true;
+                        _timerFunc = kTimerEject;
+                        if (!_f12ejectdelay)
+                            onSleepEjectTimer();
+                        else
+                            setTimerTimeout(_sleepEjectTimer, (uint64_t)_f12ejectdelay * 1000000);
+                    }
+                    else
+                    {
+                        cancelTimer(_sleepEjectTimer);
                     }
-                    OSSafeReleaseNULL(num);
-                    OSSafeReleaseNULL(key);
-                    service->release();
                 }
-            }
-            break;
+                break;
+        }
     }
 
 #ifdef DEBUG
@@ -1781,46 +2397,12 @@ bool ApplePS2Keyboard::dispatchKeyboardEventWithPacket(const UInt8* packet)
             genADB = genADB * 10 + digit;
         DEBUG_LOG("%s: genADB = %d\n", getName(), genADB);
         keyCode = 0;    // eat it
+        adbKeyCode = _PS2ToADBMap[keyCode];
     }
 #endif
     
     // We have a valid key event -- dispatch it to our superclass.
     
-    // map scan code to Apple code
-    UInt8 adbKeyCode = _PS2ToADBMap[keyCode];
-    bool eatKey = false;
-    
-    // special cases
-    switch (adbKeyCode)
-    {
-        case 0x90:
-        case 0x91:
-            if (_brightnessLevels)
-            {
-                modifyScreenBrightness(adbKeyCode, goingDown);
-                adbKeyCode = DEADKEY;
-            }
-            break;
-        case 0x92: // eject
-            if (0 == _PS2modifierState)
-            {
-                if (goingDown)
-                {
-                    eatKey = true;
-                    _timerFunc = kTimerEject;
-                    if (!_f12ejectdelay)
-                        onSleepEjectTimer();
-                    else
-                        setTimerTimeout(_sleepEjectTimer, (uint64_t)_f12ejectdelay * 1000000);
-                }
-                else
-                {
-                    cancelTimer(_sleepEjectTimer);
-                }
-            }
-            break;
-    }
-
 #ifdef DEBUG_VERBOSE
     if (adbKeyCode == DEADKEY && 0 != keyCode)
         DEBUG_LOG("%s: Unknown ADB key for PS2 scancode: 0x%x\n", getName(), scanCode);
@@ -1841,21 +2423,25 @@ bool ApplePS2Keyboard::dispatchKeyboardEventWithPacket(const UInt8* packet)
             IOLog("%s: sending key %x=%x, %x=%x %s\n", getName(), keyCodeRaw > KBV_NUM_SCANCODES ? (keyCodeRaw & 0xFF) | 0xe000 : keyCodeRaw, keyCode > KBV_NUM_SCANCODES ? (keyCode & 0xFF) | 0xe000 : keyCode, keyCode > KBV_NUM_SCANCODES ? (keyCode & 0xFF) | 0xe000 : keyCode, adbKeyCode, goingDown?"down":"up");
     }
     
-    // allow mouse/trackpad driver to have time of last keyboard activity
-    // used to implement "PalmNoAction When Typing" and "OutsizeZoneNoAction When Typing"
+    if (!replaying())
+        publishKeyState(adbKeyCode, goingDown, now_abs);
+#ifdef SIMULATE_PASSTHRU
+    // trackpad simulates passthru buttons from keys (must be defined there as well)
     PS2KeyInfo info;
-    info.time = now_ns;
+    info.time = now_abs;
     info.adbKeyCode = adbKeyCode;
     info.goingDown = goingDown;
     info.eatKey = eatKey;
     _device->dispatchMouseMessage(kPS2M_notifyKeyPressed, &info);
+    eatKey = info.eatKey;
+#endif
     
-    if (keyCode && !info.eatKey)
+    if (keyCode && !eatKey)
     {
         // dispatch to HID system
-        if (goingDown || !(_PS2flags[keyCodeRaw] & kBreaklessKey))
+        if (goingDown || !(entry.flags & kBreaklessKey))
             dispatchKeyboardEventX(adbKeyCode, goingDown, now_abs);
-        if (goingDown && (_PS2flags[keyCodeRaw] & kBreaklessKey))
+        if (goingDown && (entry.flags & kBreaklessKey))
             dispatchKeyboardEventX(adbKeyCode, false, now_abs);
     }
     
@@ -2280,27 +2866,33 @@ void ApplePS2Keyboard::setDevicePowerState( UInt32 whatToDo )
             //
             // Enable keyboard and restore state.
             //
-            initKeyboard();
+            initKeyboard(false);
             break;
     }
 }
 
 // - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
 
-void ApplePS2Keyboard::initKeyboard()
+void ApplePS2Keyboard::initKeyboard(bool wait)
 {
+    //
+    // The keyboard is initialized with asynchronous requests, which the
+    // controller runs in order before any later blocking request.  On wake this
+    // lets the controller overlap them with the mouse's power-on wait (see
+    // ApplePS2Device::sleepSinceWake).  Each step is a separate request, so a
+    // failing step does not stop the ones after it.  With wait, the last one is
+    // blocking, so all of them are done on return.
     //
     // Reset the keyboard to its default state.
     //
 
-    TPS2Request<2> request;
-    request.commands[0].command = kPS2C_WriteDataPort;
-    request.commands[0].inOrOut = kDP_SetDefaults;
-    request.commands[1].command = kPS2C_ReadDataPortAndCompare;
-    request.commands[1].inOrOut = kSC_Acknowledge;
-    request.commandsCount = 2;
-    assert(request.commandsCount <= countof(request.commands));
-    _device->submitRequestAndBlock(&request);
+    PS2Request* request = _device->allocateRequest(2);
+    request->commands[0].command = kPS2C_WriteDataPort;
+    request->commands[0].inOrOut = kDP_SetDefaults;
+    request->commands[1].command = kPS2C_ReadDataPortAndCompare;
+    request->commands[1].inOrOut = kSC_Acknowledge;
+    request->commandsCount = 2;
+    _device->submitRequest(request);
     
     // look for any keys that are down (just in case the reset happened with keys down)
     // for each key that is down, dispatch a key up for it
@@ -2337,11 +2929,29 @@ void ApplePS2Keyboard::initKeyboard()
     // key events.
     //
     
-    setKeyboardEnable(true);
+    request = _device->allocateRequest(2);
+    request->commands[0].command = kPS2C_WriteDataPort;
+    request->commands[0].inOrOut = kDP_Enable;
+    request->commands[1].command = kPS2C_ReadDataPortAndCompare;
+    request->commands[1].inOrOut = kSC_Acknowledge;
+    request->commandsCount = 2;
+    _device->submitRequest(request);
     
     //
     // Enable keyboard Kscan -> scan code translation mode.
     //
-    _device->setCommandByte(kCB_TranslateMode, 0);
+    
+    request = _device->allocateRequest(1);
+    request->commands[0].command = kPS2C_ModifyCommandByte;
+    request->commands[0].setBits = kCB_TranslateMode;
+    request->commands[0].clearBits = 0;
+    request->commandsCount = 1;
+    if (wait)
+    {
+        _device->submitRequestAndBlock(request);
+        _device->freeRequest(request);
+    }
+    else
+        _device->submitRequest(request);
 }
 
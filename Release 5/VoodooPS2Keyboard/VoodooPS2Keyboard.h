@@ -57,6 +57,41 @@
 
 #define kBreaklessKey           0x01    // keys with this flag don't generate break codes
 
+// Fused translation for one raw scan code (see buildKeyTable)
+//  flags bit 0: kBreaklessKey
+//  flags bit 1: kSpecialKey, key has special handling in dispatchKeyboardEventWithPacket
+//  flags bit 2: kIgnoredKey, key is dropped (PrintScreen header/trailer)
+//  flags bits 3-7: modifier bit number + 1, as in the high byte of _PS2flags
+
+#define kSpecialKey             0x02
+#define kIgnoredKey             0x04
+#define kModifierShift          3
+
+struct KeyTableEntry
+{
+    UInt16 keyCode;     // after PS2 -> PS2 map
+    UInt8 adbKeyCode;   // after PS2 -> ADB map
+    UInt8 flags;
+};
+
+// Macro Inversion sequences compiled into a trie (see buildMacroTrie)
+//  node 0 is the empty sequence; each edge adds one packet's key data
+
+#define kMacroNoContinuation    0xFFFF
+
+struct MacroTrieNode
+{
+    UInt16 terminalStart;   // into _macroTerminals
+    UInt16 terminalCount;   // macros ending here, that are tried before waiting for more
+    UInt16 continuation;    // first macro that is longer, or kMacroNoContinuation
+};
+
+struct MacroTrieEdge
+{
+    UInt32 match;           // parent node << 16 | key data, edges are sorted by this
+    UInt16 child;
+};
+
 // - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
 // ApplePS2Keyboard Class Declaration
 //
@@ -66,6 +101,19 @@
 #define kPacketTimeOffset 8
 #define kPacketKeyDataLength 2
 
+#ifdef DEBUG
+// capture of raw scan codes, for reproducing stuck key/macro timing problems
+// (debug builds only: a capture holds everything typed, passwords included)
+#define kScanCodeCaptureSize 4096   // entries, must be a power of 2
+
+struct ScanCodeEntry
+{
+    uint64_t time;          // absolute time in the ring, ns since first entry when published
+    UInt8    data;          // byte as received from the controller
+    UInt8    reserved[7];
+};
+#endif
+
 class EXPORT ApplePS2Keyboard : public IOHIKeyboard
 {
     typedef IOHIKeyboard super;
@@ -73,9 +121,12 @@ class EXPORT ApplePS2Keyboard : public IOHIKeyboard
 
 private:
     ApplePS2KeyboardDevice *    _device;
+    PS2KeyState*                _keyState;
     UInt32                      _keyBitVector[KBV_NUNITS];
     UInt8                       _extendCount;
     RingBuffer<UInt8, kPacketLength*32> _ringBuffer;
+    LatencyHistogram            _latency;
+    InputStatistics             _statistics;
     UInt8                       _lastdata;
     bool                        _interruptHandlerInstalled;
     bool                        _powerControlHandlerInstalled;
@@ -89,6 +140,7 @@ private:
     UInt16                      _PS2flags[KBV_NUM_SCANCODES*2];
     UInt8                       _PS2ToADBMap[ADB_CONVERTER_LEN];
     UInt8                       _PS2ToADBMapMapped[ADB_CONVERTER_LEN];
+    KeyTableEntry               _keyTable[KBV_NUM_SCANCODES*2];
     UInt32                      _fkeymode;
     bool                        _fkeymodesupported;
     OSArray*                    _keysStandard;
@@ -130,40 +182,73 @@ private:
     UInt8*                      _macroBuffer;
     int                         _macroMax;
     int                         _macroCurrent;
+    MacroTrieNode*              _macroNodes;
+    MacroTrieEdge*              _macroEdges;
+    int                         _macroEdgeCount;
+    UInt16*                     _macroTerminals;
+    UInt16                      _macroState;
     uint64_t                    _macroMaxTime;
+    uint64_t                    _macroMaxTimeAbs;   // _macroMaxTime in absolute time
     IOTimerEventSource*         _macroTimer;
     
+#ifdef DEBUG
+    // scan code capture (see CaptureScanCodes, ScanCodeCapture)
+    ScanCodeEntry*              _scanCodes;
+    UInt32                      _scanCodeHead;
+    bool                        _captureScanCodes;
+    // replay of a capture (see ReplayScanCodes)
+    bool                        _replaying;
+    uint64_t                    _replayEvents[2];   // HID key up/down events
+#endif
+    
     virtual bool dispatchKeyboardEventWithPacket(const UInt8* packet);
     virtual void setLEDs(UInt8 ledState);
     virtual void setKeyboardEnable(bool enable);
-    virtual void initKeyboard();
+    virtual void initKeyboard(bool wait);
     virtual void setDevicePowerState(UInt32 whatToDo);
     void sendKeySequence(UInt16* pKeys);
     void modifyKeyboardBacklight(int adbKeyCode, bool goingDown);
     void modifyScreenBrightness(int adbKeyCode, bool goingDown);
+    void publishKeyState(UInt16 adbKeyCode, bool goingDown, uint64_t now_abs);
     inline bool checkModifierState(UInt16 mask)
         { return mask == (_PS2modifierState & mask); }
     
     void loadCustomPS2Map(OSArray* pArray);
     void loadBreaklessPS2(OSDictionary* dict, const char* name);
     void loadCustomADBMap(OSDictionary* dict, const char* name);
+    void buildKeyTable();
     void setParamPropertiesGated(OSDictionary* dict);
+    PS2InterruptResult processScanCode(UInt8 data, uint64_t now_abs);
+#ifdef DEBUG
+    void publishScanCodeCapture();
+    void replayScanCodes(OSData* data);
+#endif
     void onSleepEjectTimer(void);
     
     static OSData** loadMacroData(OSDictionary* dict, const char* name);
     static void freeMacroData(OSData** data);
+    void buildMacroTrie();
+    int findMacroEdge(UInt32 match);
     void onMacroTimer(void);
     bool invertMacros(const UInt8* packet);
+    bool invertMacrosLinear(const UInt8* packet);
+    static bool compareMacro(const UInt8* buffer, const UInt8* data, int count);
     void dispatchInvertBuffer();
-    static bool compareMacro(const UInt8* packet, const UInt8* data, int count);
 
 protected:
     virtual const unsigned char * defaultKeymapOfLength(UInt32 * length);
     virtual void setAlphaLockFeedback(bool locked);
     virtual void setNumLockFeedback(bool locked);
     virtual UInt32 maxKeyCodes();
+#ifdef DEBUG
+    inline bool replaying() { return _replaying; }
+    inline void dispatchKeyboardEventX(unsigned int keyCode, bool goingDown, uint64_t time)
+        { if (_replaying) ++_replayEvents[goingDown]; else dispatchKeyboardEvent(keyCode, goingDown, *(AbsoluteTime*)&time); }
+#else
+    inline bool replaying() { return false; }
     inline void dispatchKeyboardEventX(unsigned int keyCode, bool goingDown, uint64_t time)
         { dispatchKeyboardEvent(keyCode, goingDown, *(AbsoluteTime*)&time); }
+#endif
     inline void setTimerTimeout(IOTimerEventSource* timer, uint64_t time)
         { timer->setTimeout(*(AbsoluteTime*)&time); }
     inline void cancelTimer(IOTimerEventSource* timer)
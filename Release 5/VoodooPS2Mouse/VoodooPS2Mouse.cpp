@@ -83,6 +83,7 @@ bool ApplePS2Mouse::init(OSDictionary * dict)
 
   // initialize state...
   _device                    = 0;
+  _keyState                  = 0;
   _interruptHandlerInstalled = false;
   _packetByteCount           = 0;
   _lastdata                  = 0;
@@ -102,6 +103,7 @@ bool ApplePS2Mouse::init(OSDictionary * dict)
   actliketrackpad            = false;
   keytime                    = 0;
   maxaftertyping             = 500000000;
+  nanoseconds_to_absolutetime(maxaftertyping, &maxaftertypingabs);
   buttonmask                 = ~0;
   scroll                     = true;
   noled                      = false;
@@ -185,6 +187,8 @@ void ApplePS2Mouse::setParamPropertiesGated(OSDictionary * config)
             *int64vars[i].var = num->unsigned64BitValue();
             setProperty(int64vars[i].name, *int64vars[i].var, 64);
         }
+    // keytime is compared in absolute time
+    nanoseconds_to_absolutetime(maxaftertyping, &maxaftertypingabs);
     // boolean config items
     for (int i = 0; i < countof(boolvars); i++)
         if ((bl=OSDynamicCast (OSBoolean,config->getObject (boolvars[i].name))))
@@ -225,6 +229,26 @@ void ApplePS2Mouse::setParamPropertiesGated(OSDictionary * config)
         updateTouchpadLED();
     }
     
+    // interrupt-to-event latency: snapshot, optionally reset
+    if (OSBoolean* reset = OSDynamicCast(OSBoolean, config->getObject(kResetLatency)))
+    {
+        if (reset->isTrue())
+            _latency.reset();
+        _latency.publish(this);
+    }
+
+    // input statistics: snapshot, optionally reset
+    if (OSBoolean* reset = OSDynamicCast(OSBoolean, config->getObject(kResetStatistics)))
+    {
+        if (reset->isTrue())
+        {
+            _statistics.reset();
+            _ringBuffer.resetStatistics();
+        }
+        _statistics.publish(this);
+        _ringBuffer.publishStatistics(this);
+    }
+    
     // convert to IOFixed format...
     defres <<= 16;
 }
@@ -320,6 +344,7 @@ bool ApplePS2Mouse::start(IOService * provider)
 
   _device = (ApplePS2MouseDevice *)provider;
   _device->retain();
+  _keyState = _device->getKeyState();
 
   //
   // Setup workloop with command gate for thread syncronization...
@@ -625,12 +650,15 @@ PS2InterruptResult ApplePS2Mouse::interruptOccurred(UInt8 data)      // PS2Inter
     // needs to be delivered.  Process the mouse data.
     //
     
+    _latency.byteReceived();
+    _statistics.count(InputStatistics::kBytes);
     UInt8* packet = _ringBuffer.head();
     
     // special case for $AA $00, spontaneous reset (usually due to static electricity)
     if (kSC_Reset == _lastdata && 0x00 == data)
     {
         IOLog("%s: Unexpected reset (%02x %02x) request from PS/2 controller\n", getName(), _lastdata, data);
+        _statistics.count(InputStatistics::kResets);
         
         // spontaneous reset, device has announced with $AA $00, schedule a reset
         packet[0] = 0x00;
@@ -647,6 +675,7 @@ PS2InterruptResult ApplePS2Mouse::interruptOccurred(UInt8 data)      // PS2Inter
     if (_packetByteCount == 0 && ((data == kSC_Acknowledge) || !(data & 0x08)))
     {
         IOLog("%s: Unexpected byte0 data (%02x) from PS/2 controller\n", getName(), data);
+        _statistics.count(InputStatistics::kResyncs);
         
         //
         // Reset the mouse when packet synchronization is lost. Limit the number
@@ -685,12 +714,21 @@ void ApplePS2Mouse::packetReady()
     // empty the ring buffer, dispatching each packet...
     // all packets are kPacketLengthMax even if _packetLength is smaller, as they
     // are padded at interrupt time.
+    uint64_t received = _latency.beginDrain();
+    if (palm_wt || outzone_wt)
+    {
+        // time of last keyboard activity, to detect unintended input while typing
+        PS2KeyState state;
+        readKeyState(_keyState, &state);
+        keytime = state.time;
+    }
     while (_ringBuffer.count() >= kPacketLengthMax)
     {
         UInt8* packet = _ringBuffer.tail();
         if (0x00 != packet[0])
         {
             // normal packet with deltas
+            _statistics.count(InputStatistics::kPackets);
             dispatchRelativePointerEventWithPacket(_ringBuffer.tail(), _packetLength);
         }
         else
@@ -699,6 +737,9 @@ void ApplePS2Mouse::packetReady()
         }
         _ringBuffer.advanceTail(kPacketLengthMax);
     }
+    _latency.endDrain(received, this);
+    _ringBuffer.publishStatistics(this);
+    _statistics.update(this);
 }
 
 // - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
@@ -853,8 +894,6 @@ void ApplePS2Mouse::dispatchRelativePointerEventWithPacket(UInt8 * packet,
 
   uint64_t now_abs;
   clock_get_uptime(&now_abs);
-  uint64_t now_ns;
-  absolutetime_to_nanoseconds(now_abs, &now_ns);
     
   if ( packetSize > 3 )
   {
@@ -892,7 +931,7 @@ void ApplePS2Mouse::dispatchRelativePointerEventWithPacket(UInt8 * packet,
   // ignore button 1 and 2 (could be simulated by trackpad) if just after typing
   if (palm_wt || outzone_wt)
   {
-    if (now_ns-keytime <= maxaftertyping)
+    if (now_abs-keytime <= maxaftertypingabs)
        buttonmask = ~(buttons & 0x3);
     else
        buttonmask = ~0;
@@ -902,7 +941,7 @@ void ApplePS2Mouse::dispatchRelativePointerEventWithPacket(UInt8 * packet,
   if (!ignoreall)
      dispatchRelativePointerEventX(dx, mouseyinverter*dy, buttons, now_abs);
     
-  if ( dz && (!(palm_wt || outzone_wt) || now_ns-keytime > maxaftertyping))
+  if ( dz && (!(palm_wt || outzone_wt) || now_abs-keytime > maxaftertypingabs))
   {
     //
     // The Z counter is negative on an upwards scroll (away from the user),
@@ -1193,7 +1232,7 @@ void ApplePS2Mouse::setDevicePowerState( UInt32 whatToDo )
 
         case kPS2C_EnableDevice:
             // Allow time for device to initialize
-            IOSleep(wakedelay);
+            _device->sleepSinceWake(wakedelay);
             
             // Enable mouse and restore state.
             resetMouse();
@@ -1214,9 +1253,8 @@ void ApplePS2Mouse::receiveMessage(int message, void* data)
     // This allows for the keyboard driver to enable/disable the trackpad
     // when a certain keycode is pressed.
     //
-    // It also allows the trackpad driver to learn the last time a key
-    //  has been pressed, so it can implement various "ignore trackpad
-    //  input while typing" options.
+    // (The last time a key has been pressed, used for the various "ignore
+    //  trackpad input while typing" options, is read from PS2KeyState.)
     //
     switch (message)
     {
@@ -1239,30 +1277,6 @@ void ApplePS2Mouse::receiveMessage(int message, void* data)
             }
             break;
         }
-            
-        case kPS2M_notifyKeyPressed:
-        {
-            // just remember last time key pressed... this can be used in
-            // interrupt handler to detect unintended input while typing
-            PS2KeyInfo* pInfo = (PS2KeyInfo*)data;
-            switch (pInfo->adbKeyCode)
-            {
-                    // don't store key time for modifier keys going down
-                case 0x38:  // left shift
-                case 0x3c:  // right shift
-                case 0x3b:  // left control
-                case 0x3e:  // right control
-                case 0x3a:  // left alt (command)
-                case 0x3d:  // right alt
-                case 0x37:  // left windows (option)
-                case 0x36:  // right windows
-                    if (pInfo->goingDown)
-                        break;
-                default:
-                    keytime = pInfo->time;
-            }
-            break;
-        }
     }
 }
 
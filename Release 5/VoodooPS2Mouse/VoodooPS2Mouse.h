@@ -58,6 +58,8 @@ private:
   bool                  _powerControlHandlerInstalled;
   bool                  _messageHandlerInstalled;
   RingBuffer<UInt8, kPacketLengthMax*32> _ringBuffer;
+  LatencyHistogram      _latency;
+  InputStatistics       _statistics;
   UInt32                _packetByteCount;
   UInt8                 _lastdata;
   UInt32                _packetLength;
@@ -75,8 +77,10 @@ private:
   int32_t               resmode;
   int32_t               scrollres;
   int                   actliketrackpad;
-  uint64_t              keytime;
+  uint64_t              keytime;            // absolute time
+  PS2KeyState*          _keyState;          // published by keyboard
   uint64_t              maxaftertyping;
+  uint64_t              maxaftertypingabs;  // maxaftertyping in absolute time
   UInt32                buttonmask;
   bool                  outzone_wt, palm, palm_wt;
   bool                  scroll;
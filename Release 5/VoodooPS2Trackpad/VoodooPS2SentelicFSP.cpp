@@ -464,6 +464,7 @@ void ApplePS2SentelicFSP::packetReady()
         dispatchRelativePointerEventWithPacket(_ringBuffer.tail(), _packetSize);
         _ringBuffer.advanceTail(kPacketLengthMax);
     }
+    _ringBuffer.publishStatistics(this);
 }
 
 // - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
@@ -635,7 +636,7 @@ void ApplePS2SentelicFSP::setDevicePowerState( UInt32 whatToDo )
             // completed its power-on self-test and calibration.
             //
 			
-            IOSleep(1000);
+            _device->sleepSinceWake(1000);
 			
             //
             // Clear packet buffer pointer to avoid issues caused by
@@ -609,12 +609,17 @@ PS2InterruptResult ApplePS2SynapticsTouchPad::interruptOccurred(UInt8 data)
     // any BLOCKING commands to our device in this context.
     //
     
+    TIME_STAGE(kStageFraming);
+    _latency.byteReceived();
+    _statistics.count(InputStatistics::kBytes);
+    
     UInt8* packet = _ringBuffer.head();
 
     // special case for $AA $00, spontaneous reset (usually due to static electricity)
     if (kSC_Reset == _lastdata && 0x00 == data)
     {
         IOLog("%s: Unexpected reset (%02x %02x) request from PS/2 controller\n", getName(), _lastdata, data);
+        _statistics.count(InputStatistics::kResets);
         
         // spontaneous reset, device has announced with $AA $00, schedule a reset
         packet[0] = 0x00;
@@ -630,6 +635,7 @@ PS2InterruptResult ApplePS2SynapticsTouchPad::interruptOccurred(UInt8 data)
     if (0 == _packetByteCount && (data & 0xc8) != 0x80)
     {
         IOLog("%s: Unexpected byte0 data (%02x) from PS/2 controller\n", getName(), data);
+        _statistics.count(InputStatistics::kResyncs);
         
         packet[0] = 0x00;
         packet[1] = 0;  // reason=byte0
@@ -639,6 +645,7 @@ PS2InterruptResult ApplePS2SynapticsTouchPad::interruptOccurred(UInt8 data)
     if (3 == _packetByteCount && (data & 0xc8) != 0xc0)
     {
         IOLog("%s: Unexpected byte3 data (%02x) from PS/2 controller\n", getName(), data);
+        _statistics.count(InputStatistics::kResyncs);
         
         packet[0] = 0x00;
         packet[1] = 3;  // reason=byte3
@@ -673,12 +680,17 @@ PS2InterruptResult ApplePS2SynapticsTouchPad::interruptOccurred(UInt8 data)
 void ApplePS2SynapticsTouchPad::packetReady()
 {
     // empty the ring buffer, dispatching each packet...
+    // (with CoalesceEvents, relative events are merged until the buffer is empty)
+    uint64_t received = _latency.beginDrain();
+    updateKeyState();
+    beginCoalescing();
     while (_ringBuffer.count() >= kPacketLength)
     {
         UInt8* packet = _ringBuffer.tail();
         if (0x00 != packet[0])
         {
             // normal packet
+            _statistics.count(InputStatistics::kPackets);
             dispatchEventsWithPacket(_ringBuffer.tail(), kPacketLength);
         }
         else
@@ -688,6 +700,10 @@ void ApplePS2SynapticsTouchPad::packetReady()
         }
         _ringBuffer.advanceTail(kPacketLength);
     }
+    endCoalescing();
+    _latency.endDrain(received, this);
+    _ringBuffer.publishStatistics(this);
+    _statistics.update(this);
 }
 
 // - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
@@ -871,6 +887,8 @@ void ApplePS2SynapticsTouchPad::dispatchEventsWithPacket(UInt8* packet, UInt32 p
     // [4] X7 X6 X5 X4 X3 X3 X1 X0  (packet byte 1, X delta)
     // [5] Y7 Y6 Y5 Y4 Y3 Y2 Y1 Y0  (packet byte 2, Y delta)
 
+    TIME_STAGE(kStageDispatch);
+    
 	uint64_t now_abs;
 	clock_get_uptime(&now_abs);
     uint64_t now_ns;
@@ -1062,7 +1080,7 @@ void ApplePS2SynapticsTouchPad::dispatchEventsWithPacket(UInt8* packet, UInt32 p
     }
     
     // deal with "OutsidezoneNoAction When Typing"
-    if (outzone_wt && z>z_finger && now_ns-keytime < maxaftertyping &&
+    if (outzone_wt && z>z_finger && now_abs-keytime < maxaftertypingabs &&
         (x < zonel || x > zoner || y < zoneb || y > zonet))
     {
         // touch input was shortly after typing and outside the "zone"
@@ -1147,7 +1165,8 @@ void ApplePS2SynapticsTouchPad::dispatchEventsWithPacket(UInt8* packet, UInt32 p
                         DEBUG_LOG("ps2: %s trackpad.\n", ignoreall ? "enabling" : "disabling");
                         // enable/disable trackpad here
                         ignoreall = !ignoreall;
-                        updateTouchpadLED();
+                        if (!replaying())
+                            updateTouchpadLED();
                         touchmode = MODE_NOTOUCH;
                     }
                     else
@@ -1358,7 +1377,7 @@ void ApplePS2SynapticsTouchPad::dispatchEventsWithPacket(UInt8* packet, UInt32 p
                         touchmode=MODE_MOVE;
                         break;
                     }
-                    if (palm_wt && now_ns-keytime < maxaftertyping)
+                    if (palm_wt && now_abs-keytime < maxaftertypingabs)
                         break;
                     dy = (wvdivisor) ? (y-lasty+yrest) : 0;
                     dx = (whdivisor&&hscroll) ? (lastx-x+xrest) : 0;
@@ -1402,7 +1421,7 @@ void ApplePS2SynapticsTouchPad::dispatchEventsWithPacket(UInt8* packet, UInt32 p
                         inSwipeUp=1;
                         inSwipeDown=0;
                         ymoved = 0;
-                        _device->dispatchKeyboardMessage(kPS2M_swipeUp, &now_abs);
+                        dispatchKeyboardMessageX(kPS2M_swipeUp, &now_abs);
                         break;
                     }
                     if (ymoved < -swipedy && !inSwipeDown)
@@ -1410,7 +1429,7 @@ void ApplePS2SynapticsTouchPad::dispatchEventsWithPacket(UInt8* packet, UInt32 p
                         inSwipeDown=1;
                         inSwipeUp=0;
                         ymoved = 0;
-                        _device->dispatchKeyboardMessage(kPS2M_swipeDown, &now_abs);
+                        dispatchKeyboardMessageX(kPS2M_swipeDown, &now_abs);
                         break;
                     }
                     if (xmoved < -swipedx && !inSwipeRight)
@@ -1418,7 +1437,7 @@ void ApplePS2SynapticsTouchPad::dispatchEventsWithPacket(UInt8* packet, UInt32 p
                         inSwipeRight=1;
                         inSwipeLeft=0;
                         xmoved = 0;
-                        _device->dispatchKeyboardMessage(kPS2M_swipeRight, &now_abs);
+                        dispatchKeyboardMessageX(kPS2M_swipeRight, &now_abs);
                         break;
                     }
                     if (xmoved > swipedx && !inSwipeLeft)
@@ -1426,7 +1445,7 @@ void ApplePS2SynapticsTouchPad::dispatchEventsWithPacket(UInt8* packet, UInt32 p
                         inSwipeLeft=1;
                         inSwipeRight=0;
                         xmoved = 0;
-                        _device->dispatchKeyboardMessage(kPS2M_swipeLeft, &now_abs);
+                        dispatchKeyboardMessageX(kPS2M_swipeLeft, &now_abs);
                         break;
                     }
             }
@@ -1438,7 +1457,7 @@ void ApplePS2SynapticsTouchPad::dispatchEventsWithPacket(UInt8* packet, UInt32 p
 				touchmode=MODE_NOTOUCH;
 				break;
 			}
-            if (palm_wt && now_ns-keytime < maxaftertyping)
+            if (palm_wt && now_abs-keytime < maxaftertypingabs)
                 break;
             dy = y-lasty+scrollrest;
 			scrollrest = dy % vscrolldivisor;
@@ -1461,7 +1480,7 @@ void ApplePS2SynapticsTouchPad::dispatchEventsWithPacket(UInt8* packet, UInt32 p
 				touchmode=MODE_NOTOUCH;
 				break;
 			}			
-            if (palm_wt && now_ns-keytime < maxaftertyping)
+            if (palm_wt && now_abs-keytime < maxaftertypingabs)
                 break;
             dx = lastx-x+scrollrest;
 			scrollrest = dx % hscrolldivisor;
@@ -1479,7 +1498,7 @@ void ApplePS2SynapticsTouchPad::dispatchEventsWithPacket(UInt8* packet, UInt32 p
 			break;
             
 		case MODE_CSCROLL:
-            if (palm_wt && now_ns-keytime < maxaftertyping)
+            if (palm_wt && now_abs-keytime < maxaftertypingabs)
                 break;
             if (y < centery)
                 dx = x-lastx;
@@ -1508,7 +1527,7 @@ void ApplePS2SynapticsTouchPad::dispatchEventsWithPacket(UInt8* packet, UInt32 p
             buttons |= 0x1;
             // fall through
 		case MODE_PREDRAG:
-            if (!immediateclick && (!palm_wt || now_ns-keytime >= maxaftertyping))
+            if (!immediateclick && (!palm_wt || now_abs-keytime >= maxaftertypingabs))
                 buttons |= 0x1;
 		case MODE_NOTOUCH:
 			break;
@@ -1521,7 +1540,7 @@ void ApplePS2SynapticsTouchPad::dispatchEventsWithPacket(UInt8* packet, UInt32 p
 	if (isFingerTouch(z))
     {
         // taps don't count if too close to typing or if currently in momentum scroll
-        if ((!palm_wt || now_ns-keytime >= maxaftertyping) && !momentumscrollcurrent)
+        if ((!palm_wt || now_abs-keytime >= maxaftertypingabs) && !momentumscrollcurrent)
         {
             if (!isTouchMode())
             {
@@ -1703,7 +1722,7 @@ void ApplePS2SynapticsTouchPad::dispatchEventsWithPacketEW(UInt8* packet, UInt32
     }
 
     // deal with "OutsidezoneNoAction When Typing"
-    if (outzone_wt && z>z_finger && now_ns-keytime < maxaftertyping &&
+    if (outzone_wt && z>z_finger && now_abs-keytime < maxaftertypingabs &&
         (x < zonel || x > zoner || y < zoneb || y > zonet))
     {
         // touch input was shortly after typing and outside the "zone"
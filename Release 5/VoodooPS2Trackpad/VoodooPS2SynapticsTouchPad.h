@@ -73,7 +73,6 @@ protected:
     bool outzone_wt, palm, palm_wt;
     int zlimit;
     int noled;
-    uint64_t maxaftertyping;
     int mousemultiplierx, mousemultipliery;
     int mousescrollmultiplierx, mousescrollmultipliery;
     int mousemiddlescroll;
@@ -121,7 +120,6 @@ protected:
 	uint64_t touchtime;
 	uint64_t untouchtime;
 	bool wasdouble,wastriple;
-    uint64_t keytime;
     bool ignoreall;
     UInt32 passbuttons;
 #ifdef SIMULATE_PASSTHRU
@@ -135,7 +133,6 @@ protected:
     int mousecount;
     bool usb_mouse_stops_trackpad;
     
-    int _modifierdown; // state of left+right control keys
     int scrollzoommask;
     
     // for scaling x/y values
@@ -58,6 +58,7 @@ bool VoodooPS2TouchPadBase::init(OSDictionary * dict)
     
     // initialize state...
     _device = NULL;
+    _keyState = NULL;
     _interruptHandlerInstalled = false;
     _powerControlHandlerInstalled = false;
     _messageHandlerInstalled = false;
@@ -98,11 +99,14 @@ bool VoodooPS2TouchPadBase::init(OSDictionary * dict)
     zlimit = 100;
     noled = false;
     maxaftertyping = 500000000;
+    nanoseconds_to_absolutetime(maxaftertyping, &maxaftertypingabs);
     mousemultiplierx = 20;
     mousemultipliery = 20;
     mousescrollmultiplierx = 20;
     mousescrollmultipliery = 20;
     mousemiddlescroll = true;
+    trackstickmultiplier = 100;
+    trackstickaccel = 3;
     wakedelay = 1000;
     skippassthru = false;
     tapthreshx = tapthreshy = 50;
@@ -160,12 +164,29 @@ bool VoodooPS2TouchPadBase::init(OSDictionary * dict)
     _maxmiddleclicktime = 100000000;
     _fakemiddlebutton = true;
     
+    // relative event coalescing (off by default)
+    coalesceevents = false;
+    _coalescing = false;
+    _coalescedpointer = _coalescedscroll = false;
+    _coalesceddx = _coalesceddy = 0;
+    _coalescedbuttons = 0;
+    _coalescedaxis1 = _coalescedaxis2 = _coalescedaxis3 = 0;
+    _coalescedtime = 0;
+#ifdef DEBUG
+    _replaying = false;
+    _eventCount = 0;
+    _eventSumX[0] = _eventSumX[1] = 0;
+    _eventSumY[0] = _eventSumY[1] = 0;
+    _eventJumps = 0;
+#endif
+    
     ignoredeltas=0;
     ignoredeltasstart=0;
 	scrollrest=0;
     touchtime=untouchtime=0;
 	wastriple=wasdouble=false;
     keytime = 0;
+    _keyCount = 0;
     ignoreall = false;
     passbuttons = 0;
     passthru = false;
@@ -227,6 +248,7 @@ bool VoodooPS2TouchPadBase::start( IOService * provider )
 
     _device = (ApplePS2MouseDevice *) provider;
     _device->retain();
+    _keyState = _device->getKeyState();
     
     //
     // Advertise the current state of the tapping feature.
@@ -410,6 +432,25 @@ void VoodooPS2TouchPadBase::stop( IOService * provider )
 
 // - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
 
+void VoodooPS2TouchPadBase::updateKeyState()
+{
+    //
+    // Pick up keyboard activity published by the keyboard driver.  The last
+    // key time is used to detect unintended input while typing, the modifier
+    // state for drag lock, and any key cancels momentum scroll.
+    //
+    
+    PS2KeyState state;
+    readKeyState(_keyState, &state);
+    keytime = state.time;
+    _modifierdown = state.modifiers;
+    if (state.keyCount != _keyCount)
+    {
+        _keyCount = state.keyCount;
+        momentumscrollcurrent = 0;  // keys cancel momentum scroll
+    }
+}
+
 void VoodooPS2TouchPadBase::onScrollTimer(void)
 {
     //
@@ -417,6 +458,7 @@ void VoodooPS2TouchPadBase::onScrollTimer(void)
     // momentum scroll.
     //
     
+    updateKeyState();
     if (!momentumscrollcurrent)
         return;
     
@@ -602,6 +644,89 @@ void VoodooPS2TouchPadBase::onDragTimer(void)
 
 // - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
 
+static inline short clampShort(int value)
+{
+    return value < -32768 ? -32768 : value > 32767 ? 32767 : value;
+}
+
+void VoodooPS2TouchPadBase::postRelativePointerEvent(int dx, int dy, UInt32 buttonState, uint64_t now)
+{
+#ifdef DEBUG
+    _eventCount++;
+    _eventSumX[dx < 0] += abs(dx);
+    _eventSumY[dy < 0] += abs(dy);
+    if (abs(dx) > kReplayJumpDelta || abs(dy) > kReplayJumpDelta)
+        _eventJumps++;
+#endif
+    dispatchRelativePointerEvent(dx, dy, buttonState, *(AbsoluteTime*)&now);
+}
+
+void VoodooPS2TouchPadBase::postScrollWheelEvent(short deltaAxis1, short deltaAxis2, short deltaAxis3, uint64_t now)
+{
+#ifdef DEBUG
+    _eventCount++;
+    if (abs(deltaAxis1) > kReplayJumpDelta || abs(deltaAxis2) > kReplayJumpDelta)
+        _eventJumps++;
+#endif
+    dispatchScrollWheelEvent(deltaAxis1, deltaAxis2, deltaAxis3, *(AbsoluteTime*)&now);
+}
+
+void VoodooPS2TouchPadBase::dispatchKeyboardMessageX(int message, uint64_t* now)
+{
+    // swipes are delivered as key sequences by the keyboard driver
+#ifdef DEBUG
+    _eventCount++;
+#endif
+    if (!replaying())
+        _device->dispatchKeyboardMessage(message, now);
+}
+
+void VoodooPS2TouchPadBase::coalesceRelativePointerEvent(int dx, int dy, UInt32 buttonState, uint64_t now)
+{
+    // a button change is an edge and has to be seen on its own; a pending
+    // scroll event must also go first to keep pointer/scroll ordering intact
+    if (_coalescedscroll || (_coalescedpointer && buttonState != _coalescedbuttons))
+        flushCoalescedEvents();
+    
+    _coalesceddx += dx;
+    _coalesceddy += dy;
+    _coalescedbuttons = buttonState;
+    _coalescedtime = now;
+    _coalescedpointer = true;
+}
+
+void VoodooPS2TouchPadBase::coalesceScrollWheelEvent(short deltaAxis1, short deltaAxis2, short deltaAxis3, uint64_t now)
+{
+    if (_coalescedpointer)
+        flushCoalescedEvents();
+    
+    _coalescedaxis1 += deltaAxis1;
+    _coalescedaxis2 += deltaAxis2;
+    _coalescedaxis3 += deltaAxis3;
+    _coalescedtime = now;
+    _coalescedscroll = true;
+}
+
+void VoodooPS2TouchPadBase::flushCoalescedEvents()
+{
+    // at most one of these is pending (see coalesce functions above)
+    if (_coalescedpointer)
+    {
+        postRelativePointerEvent(_coalesceddx, _coalesceddy, _coalescedbuttons, _coalescedtime);
+        _coalesceddx = _coalesceddy = 0;
+        _coalescedpointer = false;
+    }
+    if (_coalescedscroll)
+    {
+        postScrollWheelEvent(clampShort(_coalescedaxis1), clampShort(_coalescedaxis2),
+                             clampShort(_coalescedaxis3), _coalescedtime);
+        _coalescedaxis1 = _coalescedaxis2 = _coalescedaxis3 = 0;
+        _coalescedscroll = false;
+    }
+}
+
+// - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+
 void VoodooPS2TouchPadBase::initTouchPad()
 {
     //
@@ -654,6 +779,8 @@ void VoodooPS2TouchPadBase::setParamPropertiesGated(OSDictionary * config)
         {"MouseMultiplierY",                &mousemultipliery},
         {"MouseScrollMultiplierX",          &mousescrollmultiplierx},
         {"MouseScrollMultiplierY",          &mousescrollmultipliery},
+        {"TrackstickMultiplier",            &trackstickmultiplier},
+        {"TrackstickAcceleration",          &trackstickaccel},
         {"WakeDelay",                       &wakedelay},
         {"TapThresholdX",                   &tapthreshx},
         {"TapThresholdY",                   &tapthreshy},
@@ -706,6 +833,7 @@ void VoodooPS2TouchPadBase::setParamPropertiesGated(OSDictionary * config)
         {"ImmediateClick",                  &immediateclick},
         {"MouseMiddleScroll",               &mousemiddlescroll},
         {"FakeMiddleButton",                &_fakemiddlebutton},
+        {"CoalesceEvents",                  &coalesceevents},
 	};
     const struct {const char* name; bool* var;} lowbitvars[]={
         {"TrackpadRightClick",              &rtap},
@@ -746,6 +874,8 @@ void VoodooPS2TouchPadBase::setParamPropertiesGated(OSDictionary * config)
             setProperty(int64vars[i].name, *int64vars[i].var, 64);
         }
     }
+    // keytime is compared in absolute time
+    nanoseconds_to_absolutetime(maxaftertyping, &maxaftertypingabs);
     // boolean config items
 	for (int i = 0; i < countof(boolvars); i++) {
 		if ((bl=OSDynamicCast (OSBoolean,config->getObject (boolvars[i].name))))
@@ -836,8 +966,333 @@ void VoodooPS2TouchPadBase::setParamPropertiesGated(OSDictionary * config)
         ignoreall = (mousecount != 0) && usb_mouse_stops_trackpad;
         touchpadToggled();
     }
+    
+    // interrupt-to-event latency: snapshot, optionally reset
+    if (OSBoolean* reset = OSDynamicCast(OSBoolean, config->getObject(kResetLatency)))
+    {
+        if (reset->isTrue())
+            _latency.reset();
+        _latency.publish(this);
+    }
+
+    // input statistics: snapshot, optionally reset
+    if (OSBoolean* reset = OSDynamicCast(OSBoolean, config->getObject(kResetStatistics)))
+    {
+        if (reset->isTrue())
+        {
+            _statistics.reset();
+            _ringBuffer.resetStatistics();
+        }
+        _statistics.publish(this);
+        _ringBuffer.publishStatistics(this);
+    }
+
+#ifdef DEBUG
+    // replay of a captured byte stream (diagnostics/decoder timing)
+    if (OSData* data = OSDynamicCast(OSData, config->getObject(kReplayPackets)))
+    {
+        // packets per packetReady call, simulating a busy workloop (see CoalesceEvents)
+        unsigned batch = 1;
+        if (OSNumber* num = OSDynamicCast(OSNumber, config->getObject(kReplayBatch)))
+            batch = num->unsigned32BitValue();
+        // drop one byte in droprate (at random), to exercise resynchronization
+        unsigned droprate = 0;
+        if (OSNumber* num = OSDynamicCast(OSNumber, config->getObject(kReplayDropRate)))
+            droprate = num->unsigned32BitValue();
+        replayPackets(data, batch, droprate);
+    }
+    
+    // snapshot (and optionally reset) stage timings
+    OSBoolean* reset = OSDynamicCast(OSBoolean, config->getObject(kResetStageTimings));
+    if (reset || config->getObject(kStageTimings))
+    {
+        if (OSDictionary* timings = copyStageTimings())
+        {
+            setProperty(kStageTimings, timings);
+            timings->release();
+        }
+        if (reset && reset->isTrue())
+        {
+            for (int i = 0; i < kStageCount; i++)
+                _stageTiming[i].reset();
+        }
+    }
+#endif
 }
 
+#ifdef DEBUG
+void VoodooPS2TouchPadBase::replayPackets(OSData* data, unsigned batch, unsigned droprate)
+{
+    //
+    // Feeds a captured byte stream through interruptOccurred/packetReady exactly
+    // as the controller would, so the decoders and the touch state machine can
+    // be exercised (and timed) without touching the trackpad.
+    //
+    // This runs gated on the workloop.  The live interrupt action is removed
+    // for the duration so real bytes do not mix with the replayed ones.  While
+    // _replaying, events and swipe messages are counted but not delivered, and
+    // no timers are armed; the touch state is restored afterwards.
+    //
+    
+    if (!_device || !_interruptHandlerInstalled)
+        return;
+    
+    const UInt8* bytes = static_cast<const UInt8*>(data->getBytesNoCopy());
+    unsigned length = data->getLength();
+    
+    _device->uninstallInterruptAction();
+    _packetByteCount = 0;
+    _ringBuffer.reset();
+    for (int i = 0; i < kStageCount; i++)
+        _stageTiming[i].reset();
+    
+    TouchState saved;
+    saveTouchState(saved);
+    _replaying = true;
+    
+    _eventCount = 0;
+    _eventSumX[0] = _eventSumX[1] = 0;
+    _eventSumY[0] = _eventSumY[1] = 0;
+    _eventJumps = 0;
+    
+    // stay well within the ring buffer
+    if (batch < 1)
+        batch = 1;
+    if (batch > 16)
+        batch = 16;
+    
+    // (fixed seed, so runs with the same droprate drop the same bytes)
+    UInt32 seed = 1;
+    unsigned dropped = 0;
+    UInt32 resyncs = _statistics.get(InputStatistics::kResyncs);
+    
+    unsigned packets = 0, pending = 0;
+    uint64_t start_abs, end_abs, elapsed_ns;
+    clock_get_uptime(&start_abs);
+    for (unsigned i = 0; i < length; i++)
+    {
+        if (droprate)
+        {
+            seed = seed * 1103515245 + 12345;
+            if ((seed >> 16) % droprate == 0)
+            {
+                dropped++;
+                continue;
+            }
+        }
+        if (kPS2IR_packetReady == interruptOccurred(bytes[i]))
+        {
+            packets++;
+            if (++pending >= batch)
+            {
+                packetReady();
+                pending = 0;
+            }
+        }
+    }
+    if (pending)
+        packetReady();
+    clock_get_uptime(&end_abs);
+    absolutetime_to_nanoseconds(end_abs - start_abs, &elapsed_ns);
+    resyncs = _statistics.get(InputStatistics::kResyncs) - resyncs;
+    
+    _replaying = false;
+    restoreTouchState(saved);
+    // nothing was armed during the replay, but anything pending from before
+    // belongs to a gesture the replay has interrupted
+    cancelTimer(scrollTimer);
+    cancelTimer(_buttonTimer);
+    cancelTimer(dragTimer);
+    momentumscrollcurrent = 0;
+    _packetByteCount = 0;
+    _ringBuffer.reset();
+    _device->installInterruptAction(this,
+                                    OSMemberFunctionCast(PS2InterruptAction,this,&VoodooPS2TouchPadBase::interruptOccurred),
+                                    OSMemberFunctionCast(PS2PacketAction, this, &VoodooPS2TouchPadBase::packetReady));
+    
+    IOLog("%s: replayed %u bytes, %u packets in %lld ns, %lld events\n", getName(), length, packets, elapsed_ns, _eventCount);
+    
+    // publish results for ioreg
+    if (OSDictionary* results = OSDictionary::withCapacity(15))
+    {
+        const struct {const char* name; uint64_t value;} values[]={
+            {"Bytes",                       length},
+            {"Packets",                     packets},
+            {"ElapsedNS",                   elapsed_ns},
+            {"NSPerPacket",                 packets ? elapsed_ns / packets : 0},
+            {"Batch",                       batch},
+            {"Events",                      _eventCount},
+            {"SumDXPositive",               _eventSumX[0]},
+            {"SumDXNegative",               _eventSumX[1]},
+            {"SumDYPositive",               _eventSumY[0]},
+            {"SumDYNegative",               _eventSumY[1]},
+            {"DroppedBytes",                dropped},
+            {"Resyncs",                     resyncs},
+            {"Jumps",                       _eventJumps},
+            {"JumpsPerKPackets",            packets ? _eventJumps * 1000 / packets : 0},
+        };
+        for (int i = 0; i < countof(values); i++)
+        {
+            if (OSNumber* num = OSNumber::withNumber(values[i].value, 64))
+            {
+                results->setObject(values[i].name, num);
+                num->release();
+            }
+        }
+        if (OSDictionary* timings = copyStageTimings())
+        {
+            results->setObject(kStageTimings, timings);
+            timings->release();
+        }
+        setProperty(kReplayResults, results);
+        results->release();
+    }
+}
+
+void VoodooPS2TouchPadBase::saveTouchState(TouchState& state)
+{
+    state.touchmode = touchmode;
+    state.lastx = lastx;
+    state.lasty = lasty;
+    state.last_fingers = last_fingers;
+    state.lastbuttons = lastbuttons;
+    state.ignoredeltas = ignoredeltas;
+    state.xrest = xrest;
+    state.yrest = yrest;
+    state.scrollrest = scrollrest;
+    state.touchx = touchx;
+    state.touchy = touchy;
+    state.touchtime = touchtime;
+    state.untouchtime = untouchtime;
+    state.wasdouble = wasdouble;
+    state.wastriple = wastriple;
+    state.ignoreall = ignoreall;
+    state.passbuttons = passbuttons;
+    state.lastx2 = lastx2;
+    state.lasty2 = lasty2;
+    state.tracksecondary = tracksecondary;
+    state.xrest2 = xrest2;
+    state.yrest2 = yrest2;
+    state.clickedprimary = clickedprimary;
+    state.inSwipeLeft = inSwipeLeft;
+    state.inSwipeRight = inSwipeRight;
+    state.inSwipeUp = inSwipeUp;
+    state.inSwipeDown = inSwipeDown;
+    state.inSwipe4Left = inSwipe4Left;
+    state.inSwipe4Right = inSwipe4Right;
+    state.inSwipe4Up = inSwipe4Up;
+    state.inSwipe4Down = inSwipe4Down;
+    state.xmoved = xmoved;
+    state.ymoved = ymoved;
+    state.mbuttonstate = _mbuttonstate;
+    state.pendingbuttons = _pendingbuttons;
+    state.buttontime = _buttontime;
+    state.momentumscroll = momentumscroll;
+    state.dy_history = dy_history;
+    state.time_history = time_history;
+    state.momentumscrollsum = momentumscrollsum;
+    state.momentumscrollcurrent = momentumscrollcurrent;
+    state.momentumscrollrest1 = momentumscrollrest1;
+    state.momentumscrollrest2 = momentumscrollrest2;
+    state.x_avg = x_avg;
+    state.y_avg = y_avg;
+    state.x2_avg = x2_avg;
+    state.y2_avg = y2_avg;
+    state.x_undo = x_undo;
+    state.y_undo = y_undo;
+    state.x2_undo = x2_undo;
+    state.y2_undo = y2_undo;
+}
+
+void VoodooPS2TouchPadBase::restoreTouchState(const TouchState& state)
+{
+    touchmode = (__typeof__(touchmode))state.touchmode;
+    lastx = state.lastx;
+    lasty = state.lasty;
+    last_fingers = state.last_fingers;
+    lastbuttons = state.lastbuttons;
+    ignoredeltas = state.ignoredeltas;
+    xrest = state.xrest;
+    yrest = state.yrest;
+    scrollrest = state.scrollrest;
+    touchx = state.touchx;
+    touchy = state.touchy;
+    touchtime = state.touchtime;
+    untouchtime = state.untouchtime;
+    wasdouble = state.wasdouble;
+    wastriple = state.wastriple;
+    ignoreall = state.ignoreall;
+    passbuttons = state.passbuttons;
+    lastx2 = state.lastx2;
+    lasty2 = state.lasty2;
+    tracksecondary = state.tracksecondary;
+    xrest2 = state.xrest2;
+    yrest2 = state.yrest2;
+    clickedprimary = state.clickedprimary;
+    inSwipeLeft = state.inSwipeLeft;
+    inSwipeRight = state.inSwipeRight;
+    inSwipeUp = state.inSwipeUp;
+    inSwipeDown = state.inSwipeDown;
+    inSwipe4Left = state.inSwipe4Left;
+    inSwipe4Right = state.inSwipe4Right;
+    inSwipe4Up = state.inSwipe4Up;
+    inSwipe4Down = state.inSwipe4Down;
+    xmoved = state.xmoved;
+    ymoved = state.ymoved;
+    _mbuttonstate = (mbuttonstate)state.mbuttonstate;
+    _pendingbuttons = state.pendingbuttons;
+    _buttontime = state.buttontime;
+    momentumscroll = state.momentumscroll;
+    dy_history = state.dy_history;
+    time_history = state.time_history;
+    momentumscrollsum = state.momentumscrollsum;
+    momentumscrollcurrent = state.momentumscrollcurrent;
+    momentumscrollrest1 = state.momentumscrollrest1;
+    momentumscrollrest2 = state.momentumscrollrest2;
+    x_avg = state.x_avg;
+    y_avg = state.y_avg;
+    x2_avg = state.x2_avg;
+    y2_avg = state.y2_avg;
+    x_undo = state.x_undo;
+    y_undo = state.y_undo;
+    x2_undo = state.x2_undo;
+    y2_undo = state.y2_undo;
+}
+
+void VoodooPS2TouchPadBase::dispatchRelativePointerEvent(int dx, int dy, UInt32 buttonState, AbsoluteTime ts)
+{
+    if (!_replaying)
+        super::dispatchRelativePointerEvent(dx, dy, buttonState, ts);
+}
+
+void VoodooPS2TouchPadBase::dispatchScrollWheelEvent(short deltaAxis1, short deltaAxis2, short deltaAxis3, AbsoluteTime ts)
+{
+    if (!_replaying)
+        super::dispatchScrollWheelEvent(deltaAxis1, deltaAxis2, deltaAxis3, ts);
+}
+
+OSDictionary* VoodooPS2TouchPadBase::copyStageTimings()
+{
+    static const char* names[kStageCount] = { "Framing", "Decode", "Bitmap", "Dispatch" };
+    
+    OSDictionary* timings = OSDictionary::withCapacity(kStageCount);
+    if (!timings)
+        return NULL;
+    for (int i = 0; i < kStageCount; i++)
+    {
+        // stages a protocol does not have stay empty and are left out
+        if (!_stageTiming[i].count())
+            continue;
+        if (OSDictionary* stage = _stageTiming[i].copyDictionary())
+        {
+            timings->setObject(names[i], stage);
+            stage->release();
+        }
+    }
+    return timings;
+}
+#endif
+
 IOReturn VoodooPS2TouchPadBase::setParamProperties(OSDictionary* dict)
 {
     ////IOReturn result = super::IOHIDevice::setParamProperties(dict);
@@ -884,7 +1339,7 @@ void VoodooPS2TouchPadBase::setDevicePowerState( UInt32 whatToDo )
             // completed its power-on self-test and calibration.
             //
 
-            IOSleep(wakedelay);
+            _device->sleepSinceWake(wakedelay);
             
             // Reset and enable the touchpad.
             initTouchPad();
@@ -902,9 +1357,8 @@ void VoodooPS2TouchPadBase::receiveMessage(int message, void* data)
     // This allows for the keyboard driver to enable/disable the trackpad
     // when a certain keycode is pressed.
     //
-    // It also allows the trackpad driver to learn the last time a key
-    //  has been pressed, so it can implement various "ignore trackpad
-    //  input while typing" options.
+    // (The last time a key has been pressed, used for the various "ignore
+    //  trackpad input while typing" options, is read from PS2KeyState.)
     //
     switch (message)
     {
@@ -928,25 +1382,12 @@ void VoodooPS2TouchPadBase::receiveMessage(int message, void* data)
             break;
         }
             
+#ifdef SIMULATE_PASSTHRU
         case kPS2M_notifyKeyPressed:
         {
-            // just remember last time key pressed... this can be used in
-            // interrupt handler to detect unintended input while typing
+            // keyboard only sends this when built with SIMULATE_PASSTHRU
+            // (key time and modifiers are read from PS2KeyState instead)
             PS2KeyInfo* pInfo = (PS2KeyInfo*)data;
-            static const int masks[] =
-            {
-                0x10,       // 0x36
-                0x100000,   // 0x37
-                0,          // 0x38
-                0,          // 0x39
-                0x080000,   // 0x3a
-                0x040000,   // 0x3b
-                0,          // 0x3c
-                0x08,       // 0x3d
-                0x04,       // 0x3e
-                0x200000,   // 0x3f
-            };
-#ifdef SIMULATE_PASSTHRU
             static int buttons = 0;
             int button;
             switch (pInfo->adbKeyCode)
@@ -976,35 +1417,8 @@ void VoodooPS2TouchPadBase::receiveMessage(int message, void* data)
                     dispatchEventsWithPacket(packet, 6);
                     pInfo->eatKey = true;
             }
-#endif
-            switch (pInfo->adbKeyCode)
-            {
-                // don't store key time for modifier keys going down
-                // track modifiers for scrollzoom feature...
-                // (note: it turns out we didn't need to do this, but leaving this code in for now in case it is useful)
-                case 0x38:  // left shift
-                case 0x3c:  // right shift
-                case 0x3b:  // left control
-                case 0x3e:  // right control
-                case 0x3a:  // left windows (option)
-                case 0x3d:  // right windows
-                case 0x37:  // left alt (command)
-                case 0x36:  // right alt
-                case 0x3f:  // osx fn (function)
-                    if (pInfo->goingDown)
-                    {
-                        _modifierdown |= masks[pInfo->adbKeyCode-0x36];
-                        break;
-                    }
-                    _modifierdown &= ~masks[pInfo->adbKeyCode-0x36];
-                    keytime = pInfo->time;
-                    break;
-                    
-                default:
-                    momentumscrollcurrent = 0;  // keys cancel momentum scroll
-                    keytime = pInfo->time;
-            }
             break;
         }
+#endif
     }
 }
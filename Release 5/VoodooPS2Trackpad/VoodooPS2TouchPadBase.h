@@ -17,6 +17,23 @@
 
 #define kPacketLength 6
 
+#ifdef DEBUG
+#define kReplayPackets          "ReplayPackets"
+#define kReplayResults          "ReplayResults"
+#define kStageTimings           "StageTimings"
+#define kResetStageTimings      "ResetStageTimings"
+#define kReplayBatch            "ReplayBatch"
+#define kReplayDropRate         "ReplayDropRate"
+
+// a single replayed event moving further than this is counted as a jump
+#define kReplayJumpDelta        64
+
+// per stage timing of the packet path (see TIME_STAGE)
+#define TIME_STAGE(stage)       StageTimer _stageTimer(_stageTiming[stage])
+#else
+#define TIME_STAGE(stage)       do { } while (0)
+#endif
+
 class EXPORT VoodooPS2TouchPadBase : public IOHIPointing
 {
     typedef IOHIPointing super;
@@ -28,6 +45,8 @@ protected:
     bool                _powerControlHandlerInstalled;
     bool                _messageHandlerInstalled;
     RingBuffer<UInt8, kPacketLength*32> _ringBuffer;
+    LatencyHistogram    _latency;
+    InputStatistics     _statistics;
     UInt32              _packetByteCount;
     UInt8               _lastdata;
     UInt16              _touchPadVersion;
@@ -58,9 +77,11 @@ protected:
     int zlimit;
     int noled;
     uint64_t maxaftertyping;
+    uint64_t maxaftertypingabs; // maxaftertyping in absolute time, for keytime
     int mousemultiplierx, mousemultipliery;
     int mousescrollmultiplierx, mousescrollmultipliery;
     int mousemiddlescroll;
+    int trackstickmultiplier, trackstickaccel;
     int wakedelay;
     int smoothinput;
     int unsmoothinput;
@@ -107,7 +128,9 @@ protected:
 	uint64_t touchtime;
 	uint64_t untouchtime;
 	bool wasdouble,wastriple;
-    uint64_t keytime;
+    uint64_t keytime;   // absolute time
+    PS2KeyState* _keyState; // published by keyboard (see updateKeyState)
+    UInt32 _keyCount;
     bool ignoreall;
     UInt32 passbuttons;
 #ifdef SIMULATE_PASSTHRU
@@ -127,6 +150,35 @@ protected:
     // for scaling x/y values
     int xupmm, yupmm;
 
+    // coalescing of relative pointer/scroll events within one packetReady
+    int coalesceevents;
+    bool _coalescing;
+    bool _coalescedpointer, _coalescedscroll;
+    int _coalesceddx, _coalesceddy;
+    UInt32 _coalescedbuttons;
+    int _coalescedaxis1, _coalescedaxis2, _coalescedaxis3;
+    uint64_t _coalescedtime;
+
+#ifdef DEBUG
+    // time spent in each stage of the packet path
+    enum
+    {
+        kStageFraming,      // interruptOccurred
+        kStageDecode,       // protocol specific field decode
+        kStageBitmap,       // multi-finger bitmap processing
+        kStageDispatch,     // touch state machine and event dispatch
+        kStageCount
+    };
+    TimeHistogram _stageTiming[kStageCount];
+
+    // events the touch state machine produced (see replayPackets); while
+    // _replaying they are only counted, never delivered
+    bool _replaying;
+    uint64_t _eventCount;
+    uint64_t _eventSumX[2], _eventSumY[2];  // [0] positive, [1] negative deltas (magnitude)
+    uint64_t _eventJumps;
+#endif
+
     // for middle button simulation
     enum mbuttonstate
     {
@@ -202,6 +254,46 @@ protected:
 
     inline bool isTouchMode() { return touchmode & 1; }
 
+#ifdef DEBUG
+    // touch state saved and restored around replayPackets
+    struct TouchState
+    {
+        int touchmode;
+        int lastx, lasty, last_fingers;
+        UInt32 lastbuttons;
+        int ignoredeltas;
+        int xrest, yrest, scrollrest;
+        int touchx, touchy;
+        uint64_t touchtime, untouchtime;
+        bool wasdouble, wastriple;
+        bool ignoreall;
+        UInt32 passbuttons;
+        int lastx2, lasty2;
+        bool tracksecondary;
+        int xrest2, yrest2;
+        bool clickedprimary;
+        uint8_t inSwipeLeft, inSwipeRight, inSwipeUp, inSwipeDown;
+        uint8_t inSwipe4Left, inSwipe4Right, inSwipe4Up, inSwipe4Down;
+        int xmoved, ymoved;
+        int mbuttonstate;
+        UInt32 pendingbuttons;
+        uint64_t buttontime;
+        bool momentumscroll;
+        SimpleAverage<int, 32> dy_history;
+        SimpleAverage<uint64_t, 32> time_history;
+        int momentumscrollsum;
+        int64_t momentumscrollcurrent, momentumscrollrest1;
+        int momentumscrollrest2;
+        SimpleAverage<int, 5> x_avg, y_avg, x2_avg, y2_avg;
+        UndecayAverage<int, int64_t, 1, 1, 2> x_undo, y_undo, x2_undo, y2_undo;
+    };
+    void saveTouchState(TouchState& state);
+    void restoreTouchState(const TouchState& state);
+    inline bool replaying() { return _replaying; }
+#else
+    inline bool replaying() { return false; }
+#endif
+
     inline bool isInDisableZone(int x, int y)
         { return x > diszl && x < diszr && y > diszb && y < diszt; }
 
@@ -225,6 +317,7 @@ protected:
 
     inline bool isFingerTouch(int z) { return z>z_finger && z<zlimit; }
 
+    void updateKeyState();
     void onScrollTimer(void);
     void onButtonTimer(void);
     void onDragTimer(void);
@@ -233,16 +326,32 @@ protected:
     UInt32 middleButton(UInt32 buttons, uint64_t now, MBComingFrom from);
 
     virtual void setParamPropertiesGated(OSDictionary* dict);
+#ifdef DEBUG
+    void replayPackets(OSData* data, unsigned batch, unsigned droprate);
+    OSDictionary* copyStageTimings();
+    virtual void dispatchRelativePointerEvent(int dx, int dy, UInt32 buttonState, AbsoluteTime ts);
+    virtual void dispatchScrollWheelEvent(short deltaAxis1, short deltaAxis2, short deltaAxis3, AbsoluteTime ts);
+#endif
 
 	virtual IOItemCount buttonCount();
 	virtual IOFixed     resolution();
     virtual bool deviceSpecificInit() = 0;
+    void coalesceRelativePointerEvent(int dx, int dy, UInt32 buttonState, uint64_t now);
+    void coalesceScrollWheelEvent(short deltaAxis1, short deltaAxis2, short deltaAxis3, uint64_t now);
+    void postRelativePointerEvent(int dx, int dy, UInt32 buttonState, uint64_t now);
+    void postScrollWheelEvent(short deltaAxis1, short deltaAxis2, short deltaAxis3, uint64_t now);
+    void flushCoalescedEvents();
+    void dispatchKeyboardMessageX(int message, uint64_t* now);
+    inline void beginCoalescing()
+        { _coalescing = coalesceevents; }
+    inline void endCoalescing()
+        { if (_coalescing) { _coalescing = false; flushCoalescedEvents(); } }
     inline void dispatchRelativePointerEventX(int dx, int dy, UInt32 buttonState, uint64_t now)
-        { dispatchRelativePointerEvent(dx, dy, buttonState, *(AbsoluteTime*)&now); }
+        { if (_coalescing) coalesceRelativePointerEvent(dx, dy, buttonState, now); else postRelativePointerEvent(dx, dy, buttonState, now); }
     inline void dispatchScrollWheelEventX(short deltaAxis1, short deltaAxis2, short deltaAxis3, uint64_t now)
-        { dispatchScrollWheelEvent(deltaAxis1, deltaAxis2, deltaAxis3, *(AbsoluteTime*)&now); }
+        { if (_coalescing) coalesceScrollWheelEvent(deltaAxis1, deltaAxis2, deltaAxis3, now); else postScrollWheelEvent(deltaAxis1, deltaAxis2, deltaAxis3, now); }
     inline void setTimerTimeout(IOTimerEventSource* timer, uint64_t time)
-        { timer->setTimeout(*(AbsoluteTime*)&time); }
+        { if (!replaying()) timer->setTimeout(*(AbsoluteTime*)&time); }
     inline void cancelTimer(IOTimerEventSource* timer)
         { timer->cancelTimeout(); }
 
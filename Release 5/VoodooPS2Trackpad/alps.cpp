@@ -95,40 +95,46 @@ static const struct alps_nibble_commands alps_v4_nibble_commands[] = {
 #define ALPS_BUTTONPAD		0x200	/* device is a clickpad */
 
 
+// (sorted by signature, for the binary search in matchTable)
 static const struct alps_model_info alps_model_data[] = {
-    { { 0x32, 0x02, 0x14 }, 0x00, ALPS_PROTO_V2, 0xf8, 0xf8, ALPS_PASS | ALPS_DUALPOINT },
-    /* Toshiba Salellite Pro M10 */
+    { { 0x20, 0x02, 0x0e }, 0x00, ALPS_PROTO_V2, 0xf8, 0xf8, ALPS_PASS | ALPS_DUALPOINT },    /* XXX */
+    { { 0x22, 0x02, 0x0a }, 0x00, ALPS_PROTO_V2, 0xf8, 0xf8, ALPS_PASS | ALPS_DUALPOINT },
+    { { 0x22, 0x02, 0x14 }, 0x00, ALPS_PROTO_V2, 0xff, 0xff, ALPS_PASS | ALPS_DUALPOINT },    /* Dell Latitude D600 */
+    { { 0x32, 0x02, 0x14 }, 0x00, ALPS_PROTO_V2, 0xf8, 0xf8, ALPS_PASS | ALPS_DUALPOINT },    /* Toshiba Salellite Pro M10 */
     { { 0x33, 0x02, 0x0a }, 0x00, ALPS_PROTO_V1, 0x88, 0xf8, 0 },               /* UMAX-530T */
+    { { 0x52, 0x01, 0x14 }, 0x00, ALPS_PROTO_V2, 0xff, 0xff,
+        ALPS_PASS | ALPS_DUALPOINT | ALPS_PS2_INTERLEAVED },                    /* Toshiba Tecra A11-11L */
     { { 0x53, 0x02, 0x0a }, 0x00, ALPS_PROTO_V2, 0xf8, 0xf8, 0 },
     { { 0x53, 0x02, 0x14 }, 0x00, ALPS_PROTO_V2, 0xf8, 0xf8, 0 },
     { { 0x60, 0x03, 0xc8 }, 0x00, ALPS_PROTO_V2, 0xf8, 0xf8, 0 },               /* HP ze1115 */
+    /* Dell Latitude E5500, E6400, E6500, Precision M4400 */
+    { { 0x62, 0x02, 0x14 }, 0x00, ALPS_PROTO_V2, 0xcf, 0xcf,
+        ALPS_PASS | ALPS_DUALPOINT | ALPS_PS2_INTERLEAVED },
     { { 0x63, 0x02, 0x0a }, 0x00, ALPS_PROTO_V2, 0xf8, 0xf8, 0 },
     { { 0x63, 0x02, 0x14 }, 0x00, ALPS_PROTO_V2, 0xf8, 0xf8, 0 },
     { { 0x63, 0x02, 0x28 }, 0x00, ALPS_PROTO_V2, 0xf8, 0xf8, ALPS_FW_BK_2 },    /* Fujitsu Siemens S6010 */
     { { 0x63, 0x02, 0x3c }, 0x00, ALPS_PROTO_V2, 0x8f, 0x8f, ALPS_WHEEL },      /* Toshiba Satellite S2400-103 */
     { { 0x63, 0x02, 0x50 }, 0x00, ALPS_PROTO_V2, 0xef, 0xef, ALPS_FW_BK_1 },    /* NEC Versa L320 */
     { { 0x63, 0x02, 0x64 }, 0x00, ALPS_PROTO_V2, 0xf8, 0xf8, 0 },
-    { { 0x63, 0x03, 0xc8 }, 0x00, ALPS_PROTO_V2, 0xf8, 0xf8, ALPS_PASS | ALPS_DUALPOINT },
-    /* Dell Latitude D800 */
+    { { 0x63, 0x03, 0xc8 }, 0x00, ALPS_PROTO_V2, 0xf8, 0xf8, ALPS_PASS | ALPS_DUALPOINT },    /* Dell Latitude D800 */
     { { 0x73, 0x00, 0x0a }, 0x00, ALPS_PROTO_V2, 0xf8, 0xf8, ALPS_DUALPOINT },  /* ThinkPad R61 8918-5QG */
     { { 0x73, 0x02, 0x0a }, 0x00, ALPS_PROTO_V2, 0xf8, 0xf8, 0 },
     { { 0x73, 0x02, 0x14 }, 0x00, ALPS_PROTO_V2, 0xf8, 0xf8, ALPS_FW_BK_2 },    /* Ahtec Laptop */
-    { { 0x20, 0x02, 0x0e }, 0x00, ALPS_PROTO_V2, 0xf8, 0xf8, ALPS_PASS | ALPS_DUALPOINT },
-    /* XXX */
-    { { 0x22, 0x02, 0x0a }, 0x00, ALPS_PROTO_V2, 0xf8, 0xf8, ALPS_PASS | ALPS_DUALPOINT },
-    { { 0x22, 0x02, 0x14 }, 0x00, ALPS_PROTO_V2, 0xff, 0xff, ALPS_PASS | ALPS_DUALPOINT },
-    /* Dell Latitude D600 */
-    /* Dell Latitude E5500, E6400, E6500, Precision M4400 */
-    { { 0x62, 0x02, 0x14 }, 0x00, ALPS_PROTO_V2, 0xcf, 0xcf,
-        ALPS_PASS | ALPS_DUALPOINT | ALPS_PS2_INTERLEAVED },
-    { { 0x73, 0x02, 0x50 }, 0x00, ALPS_PROTO_V2, 0xcf, 0xcf, ALPS_FOUR_BUTTONS },
-    /* Dell Vostro 1400 */
-    { { 0x52, 0x01, 0x14 }, 0x00, ALPS_PROTO_V2, 0xff, 0xff,
-        ALPS_PASS | ALPS_DUALPOINT | ALPS_PS2_INTERLEAVED },
-    /* Toshiba Tecra A11-11L */
+    { { 0x73, 0x02, 0x50 }, 0x00, ALPS_PROTO_V2, 0xcf, 0xcf, ALPS_FOUR_BUTTONS },   /* Dell Vostro 1400 */
     { { 0x73, 0x02, 0x64 }, 0x8a, ALPS_PROTO_V4, 0x8f, 0x8f, 0 },
 };
 
+// Touchpads not in alps_model_data, classified by their E7/EC reports.
+// Checked in order, after alps_model_data.
+static const struct alps_protocol_rule alps_protocol_rules[] = {
+    { { 0x73, 0x03, 0x50 }, true,  0x73, 0x01, 0xff, 0x00, 0xff, ALPS_PROTO_V5, 0, "V5 Dolphin" },
+    { { 0x73, 0x03, 0x50 }, true,  0x73, 0x02, 0xff, 0x00, 0xff, ALPS_PROTO_V5, ALPS_RULE_DOLPHIN_V2, "V5 Dolphin" },
+    { { 0x00, 0x00, 0x00 }, false, 0x88, 0xb0, 0xf0, 0x00, 0xff, ALPS_PROTO_V7, 0, "V7" },
+    { { 0x00, 0x00, 0x00 }, false, 0x88, 0xc0, 0xf0, 0x00, 0xff, ALPS_PROTO_V7, 0, "V7" },
+    { { 0x00, 0x00, 0x00 }, false, 0x88, 0x08, 0xff, 0x00, 0xff, ALPS_PROTO_V3_RUSHMORE, 0, "V3 Rushmore" },
+    { { 0x00, 0x00, 0x00 }, false, 0x88, 0x07, 0xff, 0x90, 0x9d, ALPS_PROTO_V3, 0, "V3 Pinnacle" },
+};
+
 // =============================================================================
 // ApplePS2ALPSGlidePoint Class Implementation
 //
@@ -173,6 +179,21 @@ ApplePS2ALPSGlidePoint *ApplePS2ALPSGlidePoint::probe(IOService *provider, SInt3
 // - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
 
 bool ApplePS2ALPSGlidePoint::deviceSpecificInit() {
+    uint64_t start_abs, now_abs, elapsed_ns;
+    clock_get_uptime(&start_abs);
+    
+    if (_identityCached) {
+        if (fastInit()) {
+            clock_get_uptime(&now_abs);
+            absolutetime_to_nanoseconds(now_abs - start_abs, &elapsed_ns);
+            _initFast.add(elapsed_ns);
+            publishInitTimings();
+            return true;
+        }
+        IOLog("ALPS: Fast init failed, falling back to full init\n");
+        ++_initFallbacks;
+        _identityCached = false;
+    }
     
     resetMouse();
     
@@ -183,12 +204,24 @@ bool ApplePS2ALPSGlidePoint::deviceSpecificInit() {
     // Setup expected packet size
     priv.pktsize = priv.proto_version == ALPS_PROTO_V4 ? 8 : 6;
     
+    // Remember the identity, for fastInit
+    _identity = priv;
+    _identityInit = hw_init;
+    
     IOLog("ALPS: Touchpad driver started\n");
     
     if (!(this->*hw_init)()) {
         goto init_fail;
     }
     
+    setupMaxes();
+    
+    _identityCached = true;
+    clock_get_uptime(&now_abs);
+    absolutetime_to_nanoseconds(now_abs - start_abs, &elapsed_ns);
+    _initFull.add(elapsed_ns);
+    publishInitTimings();
+    
     return true;
     
 init_fail:
@@ -197,10 +230,81 @@ init_fail:
     return false;
 }
 
+// - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+
+bool ApplePS2ALPSGlidePoint::fastInit() {
+    ALPSStatus_t e7;
+    
+    //
+    // Re-initializes a touchpad identified by an earlier full init (after
+    // wake, or when the touchpad is re-enabled).  A single E7 report checks
+    // that it is still the same device; the E6/EC reports and the model
+    // search are skipped, and the protocol's hw_init runs from the saved
+    // identity.
+    //
+    
+    resetMouse();
+    
+    if (!repeatCmd(kDP_SetMouseResolution, NULL, kDP_SetMouseScaling2To1, &e7) ||
+        memcmp(e7.bytes, _identityE7.bytes, sizeof(e7.bytes))) {
+        DEBUG_LOG("ALPS: E7 report changed: 0x%02x 0x%02x 0x%02x\n", e7.bytes[0], e7.bytes[1], e7.bytes[2]);
+        return false;
+    }
+    
+    priv = _identity;
+    hw_init = _identityInit;
+    
+    if (!(this->*hw_init)()) {
+        return false;
+    }
+    
+    setupMaxes();
+    
+    return true;
+}
+
+// - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+
+void ApplePS2ALPSGlidePoint::publishInitTimings() {
+    OSDictionary* dict = OSDictionary::withCapacity(3);
+    if (!dict)
+        return;
+    
+    const struct {const char* name; TimeHistogram* histogram;} histograms[]={
+        {"Full",                        &_initFull},
+        {"Fast",                        &_initFast},
+    };
+    for (int i = 0; i < countof(histograms); i++)
+    {
+        if (OSDictionary* times = histograms[i].histogram->copyDictionary())
+        {
+            dict->setObject(histograms[i].name, times);
+            times->release();
+        }
+    }
+    if (OSNumber* num = OSNumber::withNumber(_initFallbacks, 32))
+    {
+        dict->setObject("Fallbacks", num);
+        num->release();
+    }
+    setProperty("InitTimings", dict);
+    dict->release();
+}
+
+// - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+
 bool ApplePS2ALPSGlidePoint::init(OSDictionary *dict) {
     if (!super::init(dict)) {
         return false;
     }
+    
+    _identityCached = false;
+    _initFallbacks = 0;
+    _trackstickrestx = _trackstickresty = 0;
+    memset(_slots, 0, sizeof(_slots));
+    _nextSlotId = 0;
+    // (_modelOverrides was loaded by super::init, see setParamPropertiesGated)
+    
     return true;
 }
 
@@ -245,6 +349,10 @@ PS2InterruptResult ApplePS2ALPSGlidePoint::interruptOccurred(UInt8 data) {
     // any BLOCKING commands to our device in this context.
     //
     
+    TIME_STAGE(kStageFraming);
+    _latency.byteReceived();
+    _statistics.count(InputStatistics::kBytes);
+    
     UInt8* packet = _ringBuffer.head();
     packet[_packetByteCount++] = data;
     
@@ -267,6 +375,7 @@ PS2InterruptResult ApplePS2ALPSGlidePoint::interruptOccurred(UInt8 data) {
     
     /* Valid first byte */
     if ((packet[0] & priv.mask0) != priv.byte0) {
+        resyncPacket(packet);
         return kPS2IR_packetBuffering;
     }
     
@@ -285,10 +394,12 @@ PS2InterruptResult ApplePS2ALPSGlidePoint::interruptOccurred(UInt8 data) {
              * rather than reporting PSMOUSE_BAD_DATA and
              * filling the logs.
              */
+            _statistics.count(InputStatistics::kSmashed);
             _ringBuffer.advanceHead(priv.pktsize);
             _packetByteCount = 0;
             return kPS2IR_packetReady;
         }
+        resyncPacket(packet);
         return kPS2IR_packetBuffering;
     }
     
@@ -301,13 +412,53 @@ PS2InterruptResult ApplePS2ALPSGlidePoint::interruptOccurred(UInt8 data) {
     return kPS2IR_packetBuffering;
 }
 
+void ApplePS2ALPSGlidePoint::resyncPacket(UInt8 *packet) {
+    //
+    // The bytes buffered so far cannot be (the start of) a packet.  Rather
+    // than dropping them all, slide the window forward to the first byte that
+    // is a valid header and is followed only by valid data bytes, so a single
+    // dropped byte costs one packet instead of several.
+    //
+    
+    _statistics.count(InputStatistics::kResyncs);
+    
+    for (unsigned start = 1; start < _packetByteCount; start++) {
+        if ((packet[start] & priv.mask0) != priv.byte0)
+            continue;
+        
+        /* Bytes 2 - pktsize should have 0 in the highest bit */
+        unsigned i = start + 1;
+        if (priv.proto_version < ALPS_PROTO_V5) {
+            while (i < _packetByteCount && !(packet[i] & 0x80))
+                i++;
+        } else {
+            i = _packetByteCount;
+        }
+        if (i == _packetByteCount) {
+            _packetByteCount -= start;
+            memmove(packet, packet + start, _packetByteCount);
+            return;
+        }
+    }
+    _packetByteCount = 0;
+}
+
 void ApplePS2ALPSGlidePoint::packetReady() {
     // empty the ring buffer, dispatching each packet...
+    // (with CoalesceEvents, relative events are merged until the buffer is empty)
+    uint64_t received = _latency.beginDrain();
+    updateKeyState();
+    beginCoalescing();
     while (_ringBuffer.count() >= priv.pktsize) {
         UInt8 *packet = _ringBuffer.tail();
+        _statistics.count(InputStatistics::kPackets);
         (this->*process_packet)(packet);
         _ringBuffer.advanceTail(priv.pktsize);
     }
+    endCoalescing();
+    _latency.endDrain(received, this);
+    _ringBuffer.publishStatistics(this);
+    _statistics.update(this);
 }
 
 void ApplePS2ALPSGlidePoint::processPacketV1V2(UInt8 *packet) {
@@ -424,23 +575,25 @@ static void alps_get_bitmap_points(unsigned int map,
                                    int *fingers)
 {
     struct alps_bitmap_point *point;
-    int i, bit, prev_bit = 0;
+    int offset = 0, zeros, bits;
     
+    /*
+     * Each run of set bits is one contact. The first run goes to low,
+     * any later run goes to high (so high ends up with the last run).
+     * Runs are found a whole run at a time with ctz instead of walking
+     * the map bit by bit.
+     */
     point = low;
-    for (i = 0; map != 0; i++, map >>= 1) {
-        bit = map & 1;
-        if (bit) {
-            if (!prev_bit) {
-                point->start_bit = i;
-                point->num_bits = 0;
-                (*fingers)++;
-            }
-            point->num_bits++;
-        } else {
-            if (prev_bit)
-                point = high;
-        }
-        prev_bit = bit;
+    while (map != 0) {
+        zeros = __builtin_ctz(map);
+        map >>= zeros;
+        bits = ~map ? __builtin_ctz(~map) : ALPS_BITMAP_MAX_BITS;
+        point->start_bit = offset + zeros;
+        point->num_bits = bits;
+        (*fingers)++;
+        point = high;
+        offset += zeros + bits;
+        map = bits < ALPS_BITMAP_MAX_BITS ? map >> bits : 0;
     }
 }
 
@@ -457,8 +610,10 @@ static void alps_get_bitmap_points(unsigned int map,
 int ApplePS2ALPSGlidePoint::processBitmap(struct alps_data *priv,
                                           struct alps_fields *fields)
 {
+    TIME_STAGE(kStageBitmap);
     
     int i, fingers_x = 0, fingers_y = 0, fingers, closest;
+    UInt32 x1, x2, y1, y2;
     struct alps_bitmap_point x_low = {0,}, x_high = {0,};
     struct alps_bitmap_point y_low = {0,}, y_high = {0,};
     struct input_mt_pos corner[4];
@@ -495,41 +650,31 @@ int ApplePS2ALPSGlidePoint::processBitmap(struct alps_data *priv,
         y_high.num_bits = max(i, 1);
     }
     
+    /*
+     * Corner positions come straight from the tables built in setupMaxes(),
+     * which also take care of the x-bitmap order being reversed on v5
+     * and the y-bitmap order being reversed on v3 and v4.
+     */
+    x1 = priv->x_bitmap_pos[2 * x_low.start_bit + x_low.num_bits - 1];
+    x2 = priv->x_bitmap_pos[2 * x_high.start_bit + x_high.num_bits - 1];
+    y1 = priv->y_bitmap_pos[2 * y_low.start_bit + y_low.num_bits - 1];
+    y2 = priv->y_bitmap_pos[2 * y_high.start_bit + y_high.num_bits - 1];
+    
     /* top-left corner */
-    corner[0].x = (priv->x_max * (2 * x_low.start_bit + x_low.num_bits - 1)) /
-    (2 * (priv->x_bits - 1));
-    corner[0].y = (priv->y_max * (2 * y_low.start_bit + y_low.num_bits - 1)) /
-    (2 * (priv->y_bits - 1));
+    corner[0].x = x1;
+    corner[0].y = y1;
     
     /* top-right corner */
-    corner[1].x = (priv->x_max * (2 * x_high.start_bit + x_high.num_bits - 1)) /
-    (2 * (priv->x_bits - 1));
-    corner[1].y = (priv->y_max * (2 * y_low.start_bit + y_low.num_bits - 1)) /
-    (2 * (priv->y_bits - 1));
+    corner[1].x = x2;
+    corner[1].y = y1;
     
     /* bottom-right corner */
-    corner[2].x = (priv->x_max * (2 * x_high.start_bit + x_high.num_bits - 1)) /
-    (2 * (priv->x_bits - 1));
-    corner[2].y = (priv->y_max * (2 * y_high.start_bit + y_high.num_bits - 1)) /
-    (2 * (priv->y_bits - 1));
+    corner[2].x = x2;
+    corner[2].y = y2;
     
     /* bottom-left corner */
-    corner[3].x = (priv->x_max * (2 * x_low.start_bit + x_low.num_bits - 1)) /
-    (2 * (priv->x_bits - 1));
-    corner[3].y = (priv->y_max * (2 * y_high.start_bit + y_high.num_bits - 1)) /
-    (2 * (priv->y_bits - 1));
-    
-    /* x-bitmap order is reversed on v5 touchpads  */
-    if (priv->proto_version == ALPS_PROTO_V5) {
-        for (i = 0; i < 4; i++)
-            corner[i].x = priv->x_max - corner[i].x;
-    }
-    
-    /* y-bitmap order is reversed on v3 and v4 touchpads  */
-    if (priv->proto_version == ALPS_PROTO_V3 || priv->proto_version == ALPS_PROTO_V4) {
-        for (i = 0; i < 4; i++)
-            corner[i].y = priv->y_max - corner[i].y;
-    }
+    corner[3].x = x1;
+    corner[3].y = y2;
     
     /*
      * We only select a corner for the second touch once per 2 finger
@@ -636,7 +781,7 @@ void ApplePS2ALPSGlidePoint::processTrackstickPacketV3(UInt8 *packet) {
     }
     
     /* If middle button is pressed, switch to scroll mode. Else, move pointer normally */
-    if (0 == (buttons & 0x04)) {
+    if (!mousemiddlescroll || 0 == (buttons & 0x04)) {
         dispatchRelativePointerEventX(x, y, buttons, now_abs);
     } else {
         dispatchScrollWheelEventX(-y, -x, 0, now_abs);
@@ -655,6 +800,8 @@ bool ApplePS2ALPSGlidePoint::decodeButtonsV3(struct alps_fields *f, unsigned cha
 }
 
 bool ApplePS2ALPSGlidePoint::decodePinnacle(struct alps_fields *f, UInt8 *p) {
+    TIME_STAGE(kStageDecode);
+    
     f->first_mp = !!(p[4] & 0x40);
     f->is_mp = !!(p[0] & 0x40);
     
@@ -678,6 +825,8 @@ bool ApplePS2ALPSGlidePoint::decodePinnacle(struct alps_fields *f, UInt8 *p) {
 }
 
 bool ApplePS2ALPSGlidePoint::decodeRushmore(struct alps_fields *f, UInt8 *p) {
+    TIME_STAGE(kStageDecode);
+    
     f->first_mp = !!(p[4] & 0x40);
     f->is_mp = !!(p[5] & 0x40);
     
@@ -779,6 +928,8 @@ int ApplePS2ALPSGlidePoint::alps_get_mt_count(struct input_mt_pos *mt)
 bool ApplePS2ALPSGlidePoint::decodeV7(struct alps_fields *f, UInt8 *p){
     //IOLog("Decode V7 touchpad Packet... 0x%x 0x%x 0x%x 0x%x 0x%x 0x%x\n", p[0], p[1], p[2], p[3], p[4], p[5]);
     
+    TIME_STAGE(kStageDecode);
+    
     unsigned char pkt_id;
     
     pkt_id = alps_get_packet_id_v7(p);
@@ -790,7 +941,7 @@ bool ApplePS2ALPSGlidePoint::decodeV7(struct alps_fields *f, UInt8 *p){
     /*
      * NEW packets are send to indicate a discontinuity in the finger
      * coordinate reporting. Specifically a finger may have moved from
-     * slot 0 to 1 or vice versa. INPUT_MT_TRACK takes care of this for
+     * slot 0 to 1 or vice versa. trackSlotsV7 takes care of this for
      * us.
      *
      * NEW packets have 3 problems:
@@ -836,7 +987,87 @@ bool ApplePS2ALPSGlidePoint::decodeV7(struct alps_fields *f, UInt8 *p){
     return true;
 }
 
+static inline int slotDistance(const alps_slot& slot, const struct input_mt_pos& pos) {
+    return abs(slot.x - (int)pos.x) + abs(slot.y - (int)pos.y);
+}
+
+void ApplePS2ALPSGlidePoint::trackSlotsV7(struct input_mt_pos *mt, bool update_only) {
+    /*
+     * The touchpad reports two contacts, but not always in the same
+     * order; a finger may move from mt[0] to mt[1] between packets (and
+     * a NEW packet is sent when it does). Each contact is given to the
+     * slot it is nearest to, so a slot follows the same finger for as
+     * long as it is down.
+     *
+     * With update_only (NEW packets) the finger count is not known, so
+     * the active slots are only moved, never started or ended. The x of
+     * the second touch in a NEW packet can be off by 16 units (see
+     * decodeV7), so that slot keeps its previous x.
+     */
+    struct input_mt_pos in[V7_SLOTS];
+    int src[V7_SLOTS]; // contact -> index in mt
+    int count = 0;
+    for (int i = 0; i < V7_SLOTS; i++) {
+        if (mt[i].x != 0 || mt[i].y != 0) {
+            src[count] = i;
+            in[count++] = mt[i];
+        }
+    }
+    
+    int assign[V7_SLOTS]; // contact -> slot
+    bool used[V7_SLOTS] = { false, false };
+    int active = _slots[0].active + _slots[1].active;
+    
+    if (2 == active && 2 == count) {
+        // only two ways to pair them up, take the shorter
+        bool swap = slotDistance(_slots[0], in[1]) + slotDistance(_slots[1], in[0]) <
+                    slotDistance(_slots[0], in[0]) + slotDistance(_slots[1], in[1]);
+        assign[0] = swap;
+        assign[1] = !swap;
+    } else if (2 == active && 1 == count) {
+        // one finger lifted, the other keeps its slot
+        assign[0] = slotDistance(_slots[1], in[0]) < slotDistance(_slots[0], in[0]);
+    } else if (1 == active) {
+        // nearest contact stays with the finger already down
+        int slot = _slots[0].active ? 0 : 1;
+        int nearest = (2 == count && slotDistance(_slots[slot], in[1]) < slotDistance(_slots[slot], in[0]));
+        for (int i = 0; i < count; i++)
+            assign[i] = (i == nearest) ? slot : !slot;
+    } else {
+        for (int i = 0; i < count; i++)
+            assign[i] = i;
+    }
+    
+    for (int i = 0; i < count; i++) {
+        alps_slot& slot = _slots[assign[i]];
+        if (!slot.active) {
+            if (update_only)
+                continue;
+            slot.active = true;
+            slot.id = _nextSlotId++;
+        }
+        if (!update_only || 0 == src[i])
+            slot.x = in[i].x;
+        slot.y = in[i].y;
+        used[assign[i]] = true;
+    }
+    
+    if (!update_only) {
+        for (int i = 0; i < V7_SLOTS; i++) {
+            if (!used[i])
+                _slots[i].active = false;
+        }
+    }
+    
+    DEBUG_LOG("ALPS: V7 slots %d:%s(%d,%d) %d:%s(%d,%d)%s\n",
+              _slots[0].id, _slots[0].active ? "down" : "up", _slots[0].x, _slots[0].y,
+              _slots[1].id, _slots[1].active ? "down" : "up", _slots[1].x, _slots[1].y,
+              update_only ? " NEW" : "");
+}
+
 bool ApplePS2ALPSGlidePoint::decodeDolphin(struct alps_fields *f, UInt8 *p) {
+    TIME_STAGE(kStageDecode);
+    
     uint64_t palm_data = 0;
     
     f->first_mp = !!(p[0] & 0x02);
@@ -869,16 +1100,24 @@ bool ApplePS2ALPSGlidePoint::decodeDolphin(struct alps_fields *f, UInt8 *p) {
     return true;
 }
 
+template <decode_fields decode>
 void ApplePS2ALPSGlidePoint::alps_process_touchpad_packet_v3_v5(UInt8 *packet) {
     int fingers = 0;
     UInt32 buttons = 0;
-    uint64_t now_abs;
-    struct alps_fields f;
-    //ffff
+    struct alps_fields &f = priv.f;
     
-    clock_get_uptime(&now_abs);
+    /*
+     * Every packet is decoded once, straight into priv.f. A position
+     * packet fills in st, pressure and the buttons, a bitmap packet only
+     * fingers, x_map and y_map, so both halves of a multi-packet sequence
+     * end up in the same frame. A frame is only dispatched once it is
+     * complete.
+     */
+    if (priv.mp_state == ALPS_MP_IDLE) {
+        memset(&f, 0, sizeof(f));
+    }
     
-    (this->*decode_fields)(&f, packet);
+    (this->*decode)(&f, packet);
     
     /*
      * There's no single feature of touchpad position and bitmap packets
@@ -886,48 +1125,38 @@ void ApplePS2ALPSGlidePoint::alps_process_touchpad_packet_v3_v5(UInt8 *packet) {
      * that a bitmap packet should always follow a position packet with
      * bit 6 of packet[4] set.
      */
-    if (priv.multi_packet) {
+    if (f.is_mp) {
         /*
-         * Sometimes a position packet will indicate a multi-packet
-         * sequence, but then what follows is another position
-         * packet. Check for this, and when it happens process the
-         * position packet as usual.
+         * Bit 6 of byte 0 is not usually set in position packets. The only
+         * times it seems to be set is in situations where the data is
+         * suspect anyway, e.g. a palm resting flat on the touchpad. Given
+         * this combined with the fact that this bit is useful for filtering
+         * out misidentified bitmap packets, we reject anything with this
+         * bit set that doesn't complete a sequence.
          */
-        if (f.is_mp) {
-            fingers = f.fingers;
-            /*
-             * Bitmap processing uses position packet's coordinate
-             * data, so we need to do decode it first.
-             */
-            (this->*decode_fields)(&f, priv.multi_data);
-            if (processBitmap(&priv, &f) == 0) {
-                fingers = 0; /* Use st data */
-            }
-        } else {
-            priv.multi_packet = 0;
+        if (priv.mp_state != ALPS_MP_BITMAP) {
+            priv.mp_state = ALPS_MP_IDLE;
+            return;
         }
-    }
-    
-    /*
-     * Bit 6 of byte 0 is not usually set in position packets. The only
-     * times it seems to be set is in situations where the data is
-     * suspect anyway, e.g. a palm resting flat on the touchpad. Given
-     * this combined with the fact that this bit is useful for filtering
-     * out misidentified bitmap packets, we reject anything with this
-     * bit set.
-     */
-    if (f.is_mp) {
-        return;
-    }
-    
-    if (!priv.multi_packet && (f.first_mp)) {
-        priv.multi_packet = 1;
-        memcpy(priv.multi_data, packet, sizeof(priv.multi_data));
+        priv.mp_state = ALPS_MP_IDLE;
+        
+        /* Bitmap processing uses the position packet's st data */
+        fingers = f.fingers;
+        if (processBitmap(&priv, &f) == 0) {
+            fingers = 0; /* Use st data */
+        }
+    } else if (f.first_mp) {
+        /*
+         * Position packet starting a sequence. Sometimes a position packet
+         * will indicate a multi-packet sequence, but then what follows is
+         * another position packet; that one simply takes over the frame.
+         */
+        priv.mp_state = ALPS_MP_BITMAP;
         return;
+    } else {
+        priv.mp_state = ALPS_MP_IDLE;
     }
     
-    priv.multi_packet = 0;
-    
     /*
      * Sometimes the hardware sends a single packet with z = 0
      * in the middle of a stream. Real releases generate packets
@@ -969,6 +1198,7 @@ void ApplePS2ALPSGlidePoint::alps_process_touchpad_packet_v3_v5(UInt8 *packet) {
     dispatchEventsWithInfo(f.mt[0].x, f.mt[0].y, f.pressure, fingers, buttons);
 }
 
+template <decode_fields decode>
 void ApplePS2ALPSGlidePoint::processPacketV3(UInt8 *packet) {
     /*
      * v3 protocol packets come in three types, two representing
@@ -983,33 +1213,47 @@ void ApplePS2ALPSGlidePoint::processPacketV3(UInt8 *packet) {
         return;
     }
     
-    alps_process_touchpad_packet_v3_v5(packet);
+    alps_process_touchpad_packet_v3_v5<decode>(packet);
 }
 
 void ApplePS2ALPSGlidePoint::processPacketV4(UInt8 *packet) {
-    SInt32 offset;
-    //SInt32 left, right = 0;
     SInt32 fingers = 0;
     UInt32 buttons = 0;
-    struct alps_fields f;
+    struct alps_fields &f = priv.f;
     
     /*
      * v4 has a 6-byte encoding for bitmap data, but this data is
-     * broken up between 3 normal packets. Use priv.multi_packet to
-     * track our position in the bitmap packet.
+     * broken up between 3 normal packets. Each part is decoded into
+     * priv.f's x_map/y_map as it arrives; priv.mp_state tracks which
+     * part is next.
      */
     if (packet[6] & 0x40) {
         /* sync, reset position */
-        priv.multi_packet = 0;
+        priv.mp_state = ALPS_MP_IDLE;
     }
     
-    if (priv.multi_packet > 2) {
-        return;
+    if (priv.mp_state == ALPS_MP_IDLE) {
+        f.x_map = f.y_map = 0;
     }
     
-    offset = 2 * priv.multi_packet;
-    priv.multi_data[offset] = packet[6];
-    priv.multi_data[offset + 1] = packet[7];
+    switch (priv.mp_state) {
+        case ALPS_MP_IDLE:
+            f.x_map |= ((packet[6] & 0x3f) << 2) | ((packet[7] & 0x60) >> 5);
+            f.y_map |= (packet[7] & 0x1f);
+            priv.mp_state = ALPS_MP_V4_1;
+            break;
+            
+        case ALPS_MP_V4_1:
+            f.x_map |= ((packet[6] & 0x1f) << 10) | ((packet[7] & 0x60) << 3);
+            f.y_map |= ((packet[7] & 0x1f) << 5);
+            priv.mp_state = ALPS_MP_V4_2;
+            break;
+            
+        case ALPS_MP_V4_2:
+            f.y_map |= ((packet[7] & 0x01) << 10);
+            priv.mp_state = ALPS_MP_IDLE;
+            break;
+    }
     
     f.left = packet[4] & 0x01;
     f.right = packet[4] & 0x02;
@@ -1019,19 +1263,9 @@ void ApplePS2ALPSGlidePoint::processPacketV4(UInt8 *packet) {
     f.st.y = ((packet[2] & 0x7f) << 4) | (packet[3] & 0x0f);
     f.pressure = packet[5] & 0x7f;
     
-    if (++priv.multi_packet > 2) {
-        priv.multi_packet = 0;
-        
-        f.x_map = ((priv.multi_data[2] & 0x1f) << 10) |
-        ((priv.multi_data[3] & 0x60) << 3) |
-        ((priv.multi_data[0] & 0x3f) << 2) |
-        ((priv.multi_data[1] & 0x60) >> 5);
-        f.y_map = ((priv.multi_data[5] & 0x01) << 10) |
-        ((priv.multi_data[3] & 0x1f) << 5) |
-        (priv.multi_data[1] & 0x1f);
-        
+    /* the third part completes the bitmap */
+    if (priv.mp_state == ALPS_MP_IDLE) {
         fingers = processBitmap(&priv, &f);
-        
     }
     
     buttons |= f.left ? 0x01 : 0;
@@ -1040,8 +1274,65 @@ void ApplePS2ALPSGlidePoint::processPacketV4(UInt8 *packet) {
     dispatchEventsWithInfo(f.st.x, f.st.y, f.pressure, fingers, buttons);
 }
 
+int ApplePS2ALPSGlidePoint::scaleTrackstick(int delta, int& rest) {
+    /*
+     * Trackstick deltas are a force rather than a distance, so small
+     * deltas are kept fine and large ones are amplified:
+     *   x * (TrackstickMultiplier + TrackstickAcceleration * |x|) / 300
+     * With the defaults (100, 3) small deltas get close to the x/3 scale
+     * used for V3 tracksticks, and larger ones grow (10 -> 4.3, 30 -> 19).
+     * TrackstickAcceleration=0 gives exactly x/3. The remainder is carried
+     * over to the next packet so slow movement is not lost.
+     */
+    int scaled = delta * (trackstickmultiplier + trackstickaccel * abs(delta)) + rest;
+    rest = scaled % 300;
+    return scaled / 300;
+}
+
 void ApplePS2ALPSGlidePoint::processTrackstickPacketV7(UInt8 *packet){
-    //TODO: Add Trackstick support (No trackstick on Lenovo Flex 3-1480)
+    int x, y, z;
+    uint64_t now_abs;
+    UInt32 buttons = 0;
+    
+    TIME_STAGE(kStageDecode);
+    
+    /* It should be a DualPoint when received trackstick packet */
+    if (!(priv.flags & ALPS_DUALPOINT)) {
+        return;
+    }
+    
+    x = (SInt8) ((packet[2] & 0xbf) | ((packet[3] & 0x10) << 2));
+    y = (SInt8) ((packet[3] & 0x07) | (packet[4] & 0xb8) |
+                 ((packet[3] & 0x20) << 1));
+    z = (packet[5] & 0x3f) | ((packet[3] & 0x80) >> 1);
+    
+    /* Finger lifted, don't carry sub-unit movement into the next push */
+    if (0 == z) {
+        _trackstickrestx = _trackstickresty = 0;
+    }
+    
+    x = scaleTrackstick(x, _trackstickrestx);
+    y = scaleTrackstick(y, _trackstickresty);
+    
+    /* To get proper movement direction */
+    y = -y;
+    
+    clock_get_uptime(&now_abs);
+    
+    /* Unlike V3, every V7 trackstick packet carries the current buttons */
+    buttons |= (packet[1] & 0x01) ? 0x01 : 0;
+    buttons |= (packet[1] & 0x02) ? 0x02 : 0;
+    buttons |= (packet[1] & 0x04) ? 0x04 : 0;
+    
+    /*
+     * Trackstick events go straight to the HID system; the touchpad
+     * state machine (touchmode, taps, drag timers) is not involved.
+     */
+    if (mousemiddlescroll && (buttons & 0x04)) {
+        dispatchScrollWheelEventX(-y, -x, 0, now_abs);
+    } else {
+        dispatchRelativePointerEventX(x, y, buttons, now_abs);
+    }
 }
 
 void ApplePS2ALPSGlidePoint::processTouchpadPacketV7(UInt8 *packet){
@@ -1051,8 +1342,21 @@ void ApplePS2ALPSGlidePoint::processTouchpadPacketV7(UInt8 *packet){
     
     memset(&f, 0, sizeof(alps_fields));
     
-    if (!(this->*decode_fields)(&f, packet))
+    /*
+     * A NEW packet has no usable finger count or buttons (see decodeV7),
+     * so nothing is dispatched. Its positions still tell the slots where
+     * the fingers went, so the next packet is not taken as a jump.
+     */
+    if (alps_get_packet_id_v7(packet) == V7_PACKET_ID_NEW) {
+        alps_get_finger_coordinate_v7(f.mt, packet, V7_PACKET_ID_NEW);
+        trackSlotsV7(f.mt, true);
         return;
+    }
+    
+    if (!decodeV7(&f, packet))
+        return;
+    
+    trackSlotsV7(f.mt, false);
     
     buttons |= f.left ? 0x01 : 0;
     buttons |= f.right ? 0x02 : 0;
@@ -1065,19 +1369,36 @@ void ApplePS2ALPSGlidePoint::processTouchpadPacketV7(UInt8 *packet){
         buttons |= f.ts_middle ? 0x04 : 0;
     }
     
+    /*
+     * One finger is dispatched from its own slot; with more, the centre
+     * of both contacts is used, so scrolling and swipes follow both
+     * fingers and don't jump when they swap places in the packet.
+     */
+    int x = 0, y = 0, active = 0;
+    for (int i = 0; i < V7_SLOTS; i++) {
+        if (_slots[i].active) {
+            x += _slots[i].x;
+            y += _slots[i].y;
+            active++;
+        }
+    }
+    if (active) {
+        x /= active;
+        y /= active;
+    }
+    
     /* Reverse y co-ordinates to have 0 at bottom for gestures to work */
-    f.mt[0].y = priv.y_max - f.mt[0].y;
-    f.mt[1].y = priv.y_max - f.mt[1].y;
+    y = priv.y_max - y;
     
     fingers = f.fingers;
     
     //Hack because V7 doesn't report pressure
-    if (fingers != 0 && (f.mt[0].x != 0 && f.mt[0].y != 0))
+    if (fingers != 0 && active)
         f.pressure = 40;
     else
         f.pressure = 0;
     
-    dispatchEventsWithInfo(f.mt[0].x, f.mt[0].y, f.pressure, fingers, buttons);
+    dispatchEventsWithInfo(x, y, f.pressure, fingers, buttons);
 }
 
 void ApplePS2ALPSGlidePoint::processPacketV7(UInt8 *packet){
@@ -1088,6 +1409,8 @@ void ApplePS2ALPSGlidePoint::processPacketV7(UInt8 *packet){
 }
 
 void ApplePS2ALPSGlidePoint::dispatchEventsWithInfo(int xraw, int yraw, int z, int fingers, UInt32 buttonsraw) {
+    TIME_STAGE(kStageDispatch);
+    
     uint64_t now_abs;
     clock_get_uptime(&now_abs);
     uint64_t now_ns;
@@ -1096,33 +1419,9 @@ void ApplePS2ALPSGlidePoint::dispatchEventsWithInfo(int xraw, int yraw, int z, i
     DEBUG_LOG("%s::dispatchEventsWithInfo: x=%d, y=%d, z=%d, fingers=%d, buttons=%d\n",
               getName(), xraw, yraw, z, fingers, buttonsraw);
     
-    // scale x & y to the axis which has the most resolution
-    if (xupmm < yupmm) {
-        xraw = xraw * yupmm / xupmm;
-    } else if (xupmm > yupmm) {
-        yraw = yraw * xupmm / yupmm;
-    }
-    
-    /* Dr Hurt: Scale all touchpads' x axis to 6000 to be able to the same divisor for all models */
-    if (priv.proto_version == ALPS_PROTO_V2) {
-        xraw *= 6;
-        yraw *= 6;
-    }
-    
-    if (priv.proto_version > ALPS_PROTO_V2 && priv.proto_version < ALPS_PROTO_V5) {
-        xraw *= 3;
-        yraw *= 3;
-    }
-    
-    if (priv.proto_version == ALPS_PROTO_V5) {
-        xraw *= 4.4;
-        yraw *= 4.4;
-    }
-    
-    if (priv.proto_version == ALPS_PROTO_V7) {
-        xraw *= 1.5;
-        yraw *= 1.5;
-    }
+    // scale x & y (units per mm correction and per protocol scale, see setupMaxes)
+    xraw = (int)((xraw * priv.x_scale) >> 16);
+    yraw = (int)((yraw * priv.y_scale) >> 16);
     
     int x = xraw;
     int y = yraw;
@@ -1185,7 +1484,7 @@ void ApplePS2ALPSGlidePoint::dispatchEventsWithInfo(int xraw, int yraw, int z, i
     }
     
     // deal with "OutsidezoneNoAction When Typing"
-    if (outzone_wt && z > z_finger && now_ns - keytime < maxaftertyping &&
+    if (outzone_wt && z > z_finger && now_abs - keytime < maxaftertypingabs &&
         (x < zonel || x > zoner || y < zoneb || y > zonet)) {
         DEBUG_LOG("Ignore touch input after typing\n");
         // touch input was shortly after typing and outside the "zone"
@@ -1364,7 +1663,7 @@ void ApplePS2ALPSGlidePoint::dispatchEventsWithInfo(int xraw, int yraw, int z, i
                     if (palm && z > zlimit) {
                         break;
                     }
-                    if (palm_wt && now_ns - keytime < maxaftertyping) {
+                    if (palm_wt && now_abs - keytime < maxaftertypingabs) {
                         break;
                     }
                     dy = (wvdivisor) ? (y-lasty+yrest) : 0;
@@ -1409,28 +1708,28 @@ void ApplePS2ALPSGlidePoint::dispatchEventsWithInfo(int xraw, int yraw, int z, i
                         inSwipeUp = 1;
                         inSwipeDown = 0;
                         ymoved = 0;
-                        _device->dispatchKeyboardMessage(kPS2M_swipeUp, &now_abs);
+                        dispatchKeyboardMessageX(kPS2M_swipeUp, &now_abs);
                         break;
                     }
                     if (ymoved < -swipedy && !inSwipeDown && !inSwipe4Down) {
                         inSwipeDown = 1;
                         inSwipeUp = 0;
                         ymoved = 0;
-                        _device->dispatchKeyboardMessage(kPS2M_swipeDown, &now_abs);
+                        dispatchKeyboardMessageX(kPS2M_swipeDown, &now_abs);
                         break;
                     }
                     if (xmoved < -swipedx && !inSwipeRight && !inSwipe4Right) {
                         inSwipeRight = 1;
                         inSwipeLeft = 0;
                         xmoved = 0;
-                        _device->dispatchKeyboardMessage(kPS2M_swipeRight, &now_abs);
+                        dispatchKeyboardMessageX(kPS2M_swipeRight, &now_abs);
                         break;
                     }
                     if (xmoved > swipedx && !inSwipeLeft && !inSwipe4Left) {
                         inSwipeLeft = 1;
                         inSwipeRight = 0;
                         xmoved = 0;
-                        _device->dispatchKeyboardMessage(kPS2M_swipeLeft, &now_abs);
+                        dispatchKeyboardMessageX(kPS2M_swipeLeft, &now_abs);
                         break;
                     }
                     break;
@@ -1445,28 +1744,28 @@ void ApplePS2ALPSGlidePoint::dispatchEventsWithInfo(int xraw, int yraw, int z, i
                         inSwipe4Up = 1; inSwipeUp = 0;
                         inSwipe4Down = 0;
                         ymoved = 0;
-                        _device->dispatchKeyboardMessage(kPS2M_swipe4Up, &now_abs);
+                        dispatchKeyboardMessageX(kPS2M_swipe4Up, &now_abs);
                         break;
                     }
                     if (ymoved < -swipedy && !inSwipe4Down) {
                         inSwipe4Down = 1; inSwipeDown = 0;
                         inSwipe4Up = 0;
                         ymoved = 0;
-                        _device->dispatchKeyboardMessage(kPS2M_swipe4Down, &now_abs);
+                        dispatchKeyboardMessageX(kPS2M_swipe4Down, &now_abs);
                         break;
                     }
                     if (xmoved < -swipedx && !inSwipe4Right) {
                         inSwipe4Right = 1; inSwipeRight = 0;
                         inSwipe4Left = 0;
                         xmoved = 0;
-                        _device->dispatchKeyboardMessage(kPS2M_swipe4Right, &now_abs);
+                        dispatchKeyboardMessageX(kPS2M_swipe4Right, &now_abs);
                         break;
                     }
                     if (xmoved > swipedx && !inSwipe4Left) {
                         inSwipe4Left = 1; inSwipeLeft = 0;
                         inSwipe4Right = 0;
                         xmoved = 0;
-                        _device->dispatchKeyboardMessage(kPS2M_swipe4Left, &now_abs);
+                        dispatchKeyboardMessageX(kPS2M_swipe4Left, &now_abs);
                         break;
                     }
             }
@@ -1477,7 +1776,7 @@ void ApplePS2ALPSGlidePoint::dispatchEventsWithInfo(int xraw, int yraw, int z, i
                 touchmode = MODE_NOTOUCH;
                 break;
             }
-            if (palm_wt && now_ns - keytime < maxaftertyping) {
+            if (palm_wt && now_abs - keytime < maxaftertypingabs) {
                 break;
             }
             dy = y-lasty+scrollrest;
@@ -1508,7 +1807,7 @@ void ApplePS2ALPSGlidePoint::dispatchEventsWithInfo(int xraw, int yraw, int z, i
                 touchmode = MODE_NOTOUCH;
                 break;
             }
-            if (palm_wt && now_ns - keytime < maxaftertyping) {
+            if (palm_wt && now_abs - keytime < maxaftertypingabs) {
                 break;
             }
             dx = lastx-x+scrollrest;
@@ -1527,7 +1826,7 @@ void ApplePS2ALPSGlidePoint::dispatchEventsWithInfo(int xraw, int yraw, int z, i
             break;
             
         case MODE_CSCROLL:
-            if (palm_wt && now_ns - keytime < maxaftertyping) {
+            if (palm_wt && now_abs - keytime < maxaftertypingabs) {
                 break;
             }
             
@@ -1563,7 +1862,7 @@ void ApplePS2ALPSGlidePoint::dispatchEventsWithInfo(int xraw, int yraw, int z, i
             buttons |= 0x1;
             // fall through
         case MODE_PREDRAG:
-            if (!immediateclick && (!palm_wt || now_ns - keytime >= maxaftertyping)) {
+            if (!immediateclick && (!palm_wt || now_abs - keytime >= maxaftertypingabs)) {
                 buttons |= 0x1;
             }
         case MODE_NOTOUCH:
@@ -1575,7 +1874,7 @@ void ApplePS2ALPSGlidePoint::dispatchEventsWithInfo(int xraw, int yraw, int z, i
     // capture time of tap, and watch for double/triple tap
     if (isFingerTouch(z)) {
         // taps don't count if too close to typing or if currently in momentum scroll
-        if ((!palm_wt || now_ns - keytime >= maxaftertyping) && !momentumscrollcurrent) {
+        if ((!palm_wt || now_abs - keytime >= maxaftertypingabs) && !momentumscrollcurrent) {
             if (!isTouchMode()) {
                 touchtime = now_ns;
                 touchx = x;
@@ -1948,164 +2247,227 @@ bool ApplePS2ALPSGlidePoint::setSampleRateAndEnable(UInt8 rate) {
 }
 
 
-int ApplePS2ALPSGlidePoint::commandModeReadReg(int addr) {
-    TPS2Request<4> request;
-    ALPSStatus_t status;
-    
-    if (!commandModeSetAddr(addr)) {
-        DEBUG_LOG("Failed to set addr to read register\n");
-        return -1;
+/*
+ * Command mode request composition
+ *
+ * Each append function adds the PS/2 commands for one command mode
+ * operation to the end of a request (commandsCount is the fill level) and
+ * returns false, leaving the request as it was, if they do not fit.  That
+ * way a whole enter/set address/read or write/exit sequence goes through
+ * the workloop as one submitRequestAndBlock, instead of one per nibble.
+ */
+bool ApplePS2ALPSGlidePoint::appendCommand(TPS2Request<> *request, PS2CommandEnum command, UInt8 data) {
+    if (request->commandsCount >= countof(request->commands)) {
+        return false;
     }
     
-    request.commands[0].command = kPS2C_SendMouseCommandAndCompareAck;
-    request.commands[0].inOrOut = kDP_GetMouseInformation; //sync..
-    request.commands[1].command = kPS2C_ReadDataPort;
-    request.commands[1].inOrOut = 0;
-    request.commands[2].command = kPS2C_ReadDataPort;
-    request.commands[2].inOrOut = 0;
-    request.commands[3].command = kPS2C_ReadDataPort;
-    request.commands[3].inOrOut = 0;
-    request.commandsCount = 4;
-    assert(request.commandsCount <= countof(request.commands));
-    _device->submitRequestAndBlock(&request);
+    request->commands[request->commandsCount].command = command;
+    request->commands[request->commandsCount++].inOrOut = data;
+    return true;
+}
+
+bool ApplePS2ALPSGlidePoint::appendNibble(TPS2Request<> *request, int nibble) {
+    UInt8 count = request->commandsCount;
+    SInt32 command;
+    int send, receive, i;
     
-    if (request.commandsCount != 4) {
-        return -1;
+    if (nibble > 0xf) {
+        IOLog("%s::appendNibble ERROR: nibble value is greater than 0xf, command may fail\n", getName());
     }
     
-    status.bytes[0] = request.commands[1].inOrOut;
-    status.bytes[1] = request.commands[2].inOrOut;
-    status.bytes[2] = request.commands[3].inOrOut;
+    command = priv.nibble_commands[nibble].command;
+    send = (command >> 12 & 0xf);
+    receive = (command >> 8 & 0xf);
+    
+    // send can never be > 1 since all we have available is the data
+    // from the alps_nibble_commands which is 1 byte
+    if (send > 1) {
+        IOLog("%s::appendNibble: ERROR: Cannot process nibble that sends more than 1 byte of data.\n", getName());
+        return false;
+    }
     
-    DEBUG_LOG("ApplePS2ALPSGlidePoint read reg result: { 0x%02x, 0x%02x, 0x%02x }\n", status.bytes[0], status.bytes[1], status.bytes[2]);
+    bool ok = appendCommand(request, kPS2C_SendMouseCommandAndCompareAck, command & 0xff);
+    if (send > 0) {
+        ok = ok && appendCommand(request, kPS2C_SendMouseCommandAndCompareAck, priv.nibble_commands[nibble].data);
+    }
     
-    /* The address being read is returned in the first 2 bytes
-     * of the result. Check that the address matches the expected
-     * address.
-     */
-    if (addr != ((status.bytes[0] << 8) | status.bytes[1])) {
-        DEBUG_LOG("ApplePS2ALPSGlidePoint ERROR: read wrong registry value, expected: %x\n", addr);
-        return -1;
+    // Receive the amount of data for the given command
+    // Even though we don't read the data, we should drain the data port to follow protocol
+    for (i = 0; i < receive; i++) {
+        ok = ok && appendCommand(request, kPS2C_ReadDataPort, 0);
     }
     
-    return status.bytes[2];
+    if (!ok) {
+        request->commandsCount = count;
+    }
+    return ok;
 }
 
-bool ApplePS2ALPSGlidePoint::commandModeWriteReg(int addr, UInt8 value) {
-    
-    if (!commandModeSetAddr(addr)) {
+bool ApplePS2ALPSGlidePoint::appendEnterCommandMode(TPS2Request<> *request) {
+    // same as repeatCmd(NULL, NULL, kDP_MouseResetWrap, ...), report ignored
+    UInt8 count = request->commandsCount;
+    
+    if (!(appendCommand(request, kPS2C_SendMouseCommandAndCompareAck, kDP_MouseResetWrap) &&
+          appendCommand(request, kPS2C_SendMouseCommandAndCompareAck, kDP_MouseResetWrap) &&
+          appendCommand(request, kPS2C_SendMouseCommandAndCompareAck, kDP_MouseResetWrap) &&
+          appendCommand(request, kPS2C_SendMouseCommandAndCompareAck, kDP_GetMouseInformation) &&
+          appendCommand(request, kPS2C_ReadDataPort, 0) &&
+          appendCommand(request, kPS2C_ReadDataPort, 0) &&
+          appendCommand(request, kPS2C_ReadDataPort, 0))) {
+        request->commandsCount = count;
         return false;
     }
+    return true;
+}
+
+bool ApplePS2ALPSGlidePoint::appendExitCommandMode(TPS2Request<> *request) {
+    return appendCommand(request, kPS2C_SendMouseCommandAndCompareAck, kDP_SetMouseStreamMode);
+}
+
+bool ApplePS2ALPSGlidePoint::appendSetAddr(TPS2Request<> *request, int addr) {
+    UInt8 count = request->commandsCount;
+    int i;
     
-    return commandModeWriteReg(value);
+    bool ok = appendCommand(request, kPS2C_SendMouseCommandAndCompareAck, priv.addr_command);
+    for (i = 12; ok && i >= 0; i -= 4) {
+        ok = appendNibble(request, (addr >> i) & 0xf);
+    }
+    
+    if (!ok) {
+        request->commandsCount = count;
+    }
+    return ok;
 }
 
-bool ApplePS2ALPSGlidePoint::commandModeWriteReg(UInt8 value) {
-    if (!commandModeSendNibble((value >> 4) & 0xf)) {
+bool ApplePS2ALPSGlidePoint::appendReadReg(TPS2Request<> *request, int addr, int *result) {
+    // *result is the index of the 3 byte report, see readRegResult
+    UInt8 count = request->commandsCount;
+    
+    if (!(appendSetAddr(request, addr) &&
+          appendCommand(request, kPS2C_SendMouseCommandAndCompareAck, kDP_GetMouseInformation))) { //sync..
+        request->commandsCount = count;
         return false;
     }
-    if (!commandModeSendNibble(value & 0xf)) {
+    *result = request->commandsCount;
+    if (!(appendCommand(request, kPS2C_ReadDataPort, 0) &&
+          appendCommand(request, kPS2C_ReadDataPort, 0) &&
+          appendCommand(request, kPS2C_ReadDataPort, 0))) {
+        request->commandsCount = count;
         return false;
     }
-    
     return true;
 }
 
-bool ApplePS2ALPSGlidePoint::commandModeSendNibble(int nibble) {
-    SInt32 command;
-    // The largest amount of requests we will have is 2 right now
-    // 1 for the initial command, and 1 for sending data OR 1 for receiving data
-    // If the nibble commands at the top change then this will need to change as
-    // well. For now we will just validate that the request will not overload
-    // this object.
-    TPS2Request<2> request;
-    int cmdCount = 0, send = 0, receive = 0, i;
+bool ApplePS2ALPSGlidePoint::appendWriteReg(TPS2Request<> *request, UInt8 value) {
+    UInt8 count = request->commandsCount;
     
-    if (nibble > 0xf) {
-        IOLog("%s::commandModeSendNibble ERROR: nibble value is greater than 0xf, command may fail\n", getName());
+    if (!(appendNibble(request, (value >> 4) & 0xf) &&
+          appendNibble(request, value & 0xf))) {
+        request->commandsCount = count;
+        return false;
     }
+    return true;
+}
+
+bool ApplePS2ALPSGlidePoint::appendWriteReg(TPS2Request<> *request, int addr, UInt8 value) {
+    UInt8 count = request->commandsCount;
     
-    request.commands[cmdCount].command = kPS2C_SendMouseCommandAndCompareAck;
-    command = priv.nibble_commands[nibble].command;
-    request.commands[cmdCount++].inOrOut = command & 0xff;
-    
-    send = (command >> 12 & 0xf);
-    receive = (command >> 8 & 0xf);
-    
-    // Validate that the number of requests will not exceed our buffer as
-    // defined above
-    // Also, send can never be > 1 since all we have available is the data
-    // from the alps_nibble_commands which is 1 byte
-    if ((send > 1) || ((send + receive + 1) > 2)) {
-        IOLog("%s::commandModeSendNibble: ERROR: Nibble commands have changed. Cannot process nibble that sends or receives more than 1 byte of data.\n", getName());
+    if (!(appendSetAddr(request, addr) && appendWriteReg(request, value))) {
+        request->commandsCount = count;
         return false;
     }
+    return true;
+}
+
+bool ApplePS2ALPSGlidePoint::submitCommands(TPS2Request<> *request) {
+    // on failure commandsCount is the index of the command that failed
+    UInt8 count = request->commandsCount;
+    _device->submitRequestAndBlock(request);
+    return request->commandsCount == count;
+}
+
+int ApplePS2ALPSGlidePoint::readRegResult(TPS2Request<> *request, int result, int addr) {
+    ALPSStatus_t status;
     
-    //DEBUG_LOG("%s: send nibble: nibble=%x command info=%x command=0x%02x send=%d, receive=%d, data=0x%02x\n",
-    //          getName(), nibble, command, request.commands[0].inOrOut, send, receive, priv.nibble_commands[nibble].data);
+    status.bytes[0] = request->commands[result].inOrOut;
+    status.bytes[1] = request->commands[result+1].inOrOut;
+    status.bytes[2] = request->commands[result+2].inOrOut;
     
-    if (send > 0) {
-        request.commands[cmdCount].command = kPS2C_SendMouseCommandAndCompareAck;
-        request.commands[cmdCount++].inOrOut = priv.nibble_commands[nibble].data;
-    }
+    DEBUG_LOG("ApplePS2ALPSGlidePoint read reg result: { 0x%02x, 0x%02x, 0x%02x }\n", status.bytes[0], status.bytes[1], status.bytes[2]);
     
-    // Receive the amount of data for the given command
-    // Even though we don't read the data, we should drain the data port to follow protocol
-    for (i = 0; i < receive; i++) {
-        request.commands[cmdCount].command = kPS2C_ReadDataPort;
-        request.commands[cmdCount++].inOrOut = 0;
+    /* The address being read is returned in the first 2 bytes
+     * of the result. Check that the address matches the expected
+     * address.
+     */
+    if (addr != ((status.bytes[0] << 8) | status.bytes[1])) {
+        DEBUG_LOG("ApplePS2ALPSGlidePoint ERROR: read wrong registry value, expected: %x\n", addr);
+        return -1;
     }
     
-    request.commandsCount = cmdCount;
-    assert(request.commandsCount <= countof(request.commands));
-    
-    _device->submitRequestAndBlock(&request);
+    return status.bytes[2];
+}
+
+int ApplePS2ALPSGlidePoint::commandModeReadReg(int addr) {
+    TPS2Request<> request;
+    int result;
     
-    //DEBUG_LOG("%s: num nibble commands=%d, expected=%d\n", getName(), request.commandsCount, cmdCount);
+    if (!appendReadReg(&request, addr, &result) || !submitCommands(&request)) {
+        DEBUG_LOG("Failed to read register 0x%04x\n", addr);
+        return -1;
+    }
     
-    return request.commandsCount == cmdCount;
+    return readRegResult(&request, result, addr);
 }
 
-bool ApplePS2ALPSGlidePoint::commandModeSetAddr(int addr) {
-    
-    TPS2Request<1> request;
-    int i, nibble;
+bool ApplePS2ALPSGlidePoint::commandModeWriteReg(int addr, UInt8 value) {
+    TPS2Request<> request;
     
-    //    DEBUG_LOG("command mode set addr with addr command: 0x%02x\n", priv.addr_command);
-    request.commands[0].command = kPS2C_SendMouseCommandAndCompareAck;
-    request.commands[0].inOrOut = priv.addr_command;
-    request.commandsCount = 1;
-    _device->submitRequestAndBlock(&request);
+    return appendWriteReg(&request, addr, value) && submitCommands(&request);
+}
+
+bool ApplePS2ALPSGlidePoint::commandModeWriteReg(UInt8 value) {
+    TPS2Request<> request;
     
-    if (request.commandsCount != 1) {
-        return false;
-    }
+    return appendWriteReg(&request, value) && submitCommands(&request);
+}
+
+bool ApplePS2ALPSGlidePoint::commandModeSendNibble(int nibble) {
+    TPS2Request<> request;
     
-    for (i = 12; i >= 0; i -= 4) {
-        nibble = (addr >> i) & 0xf;
-        if (!commandModeSendNibble(nibble)) {
-            return false;
-        }
-    }
+    return appendNibble(&request, nibble) && submitCommands(&request);
+}
+
+bool ApplePS2ALPSGlidePoint::commandModeSetAddr(int addr) {
+    TPS2Request<> request;
     
-    return true;
+    return appendSetAddr(&request, addr) && submitCommands(&request);
 }
 
 bool ApplePS2ALPSGlidePoint::passthroughModeV3(int regBase, bool enable) {
-    int regVal;
-    bool ret = false;
+    TPS2Request<> request;
+    int regVal, result, entered, written;
     
     DEBUG_LOG("passthrough mode enable=%d\n", enable);
     
-    if (!enterCommandMode()) {
-        IOLog("ERROR: Failed to enter command mode while enabling passthrough mode\n");
+    // enter command mode and read the register in one round trip...
+    appendEnterCommandMode(&request);
+    entered = request.commandsCount;
+    if (!appendReadReg(&request, regBase + 0x0008, &result)) {
         return false;
     }
-    
-    regVal = commandModeReadReg(regBase + 0x0008);
+    if (!submitCommands(&request)) {
+        if (request.commandsCount < entered) {
+            IOLog("ERROR: Failed to enter command mode while enabling passthrough mode\n");
+            return false;
+        }
+        regVal = -1;
+    } else {
+        regVal = readRegResult(&request, result, regBase + 0x0008);
+    }
     if (regVal == -1) {
         IOLog("Failed to read register while setting up passthrough mode\n");
-        goto error;
+        exitCommandMode();
+        return false;
     }
     
     if (enable) {
@@ -2114,15 +2476,27 @@ bool ApplePS2ALPSGlidePoint::passthroughModeV3(int regBase, bool enable) {
         regVal &= ~0x01;
     }
     
-    ret = commandModeWriteReg(regVal);
-    
-error:
-    if (!exitCommandMode()) {
-        IOLog("ERROR: failed to exit command mode while enabling passthrough mode v3\n");
+    // ...and write it back and exit in another
+    request.commandsCount = 0;
+    if (!appendWriteReg(&request, regVal)) {
+        exitCommandMode();
         return false;
     }
+    written = request.commandsCount;
+    appendExitCommandMode(&request);
+    if (submitCommands(&request)) {
+        return true;
+    }
     
-    return ret;
+    if (request.commandsCount < written) {
+        // write failed, so exit was not sent
+        if (!exitCommandMode()) {
+            IOLog("ERROR: failed to exit command mode while enabling passthrough mode v3\n");
+        }
+        return false;
+    }
+    IOLog("ERROR: failed to exit command mode while enabling passthrough mode v3\n");
+    return false;
 };
 
 bool ApplePS2ALPSGlidePoint::passthroughModeV2(bool enable) {
@@ -2194,7 +2568,7 @@ error:
 IOReturn ApplePS2ALPSGlidePoint::setupTrackstickV3(int regBase) {
     IOReturn ret = 0;
     ALPSStatus_t report;
-    TPS2Request<3> request;
+    TPS2Request<> request;
     
     if (!passthroughModeV3(regBase, true)) {
         return kIOReturnIOError;
@@ -2210,31 +2584,26 @@ IOReturn ApplePS2ALPSGlidePoint::setupTrackstickV3(int regBase) {
          * work at all and the trackstick just emits normal
          * PS/2 packets.
          */
-        request.commands[0].command = kPS2C_SendMouseCommandAndCompareAck;
-        request.commands[0].inOrOut = kDP_SetMouseScaling1To1;
-        request.commands[1].command = kPS2C_SendMouseCommandAndCompareAck;
-        request.commands[1].inOrOut = kDP_SetMouseScaling1To1;
-        request.commands[2].command = kPS2C_SendMouseCommandAndCompareAck;
-        request.commands[2].inOrOut = kDP_SetMouseScaling1To1;
-        request.commandsCount = 3;
-        assert(request.commandsCount <= countof(request.commands));
-        _device->submitRequestAndBlock(&request);
-        if (request.commandsCount != 3) {
-            IOLog("ERROR: error sending magic E6 scaling sequence\n");
-            ret = kIOReturnIOError;
-            goto error;
-        }
-        if (!(commandModeSendNibble(0x9) && commandModeSendNibble(0x4))) {
-            IOLog("ERROR: error sending magic E6 nibble sequence\n");
+        appendCommand(&request, kPS2C_SendMouseCommandAndCompareAck, kDP_SetMouseScaling1To1);
+        appendCommand(&request, kPS2C_SendMouseCommandAndCompareAck, kDP_SetMouseScaling1To1);
+        appendCommand(&request, kPS2C_SendMouseCommandAndCompareAck, kDP_SetMouseScaling1To1);
+        if (!(appendNibble(&request, 0x9) && appendNibble(&request, 0x4) && submitCommands(&request))) {
+            if (request.commandsCount < 3) {
+                IOLog("ERROR: error sending magic E6 scaling sequence\n");
+            } else {
+                IOLog("ERROR: error sending magic E6 nibble sequence\n");
+            }
             ret = kIOReturnIOError;
             goto error;
         }
         DEBUG_LOG("Sent magic E6 sequence\n");
         
         /* Ensures trackstick packets are in the correct format */
-        if (!(enterCommandMode() &&
-              commandModeWriteReg(regBase + 0x0008, 0x82) &&
-              exitCommandMode())) {
+        request.commandsCount = 0;
+        if (!(appendEnterCommandMode(&request) &&
+              appendWriteReg(&request, regBase + 0x0008, 0x82) &&
+              appendExitCommandMode(&request) &&
+              submitCommands(&request))) {
             ret = kIOReturnIOError;
             goto error;
         }
@@ -2407,7 +2776,13 @@ bool ApplePS2ALPSGlidePoint::absoluteModeV4() {
 }
 
 bool ApplePS2ALPSGlidePoint::hwInitV4() {
+    static const struct { int addr; UInt8 value; } regs[] = {
+        { 0x0007, 0x8c }, { 0x0149, 0x03 }, { 0x0160, 0x03 }, { 0x017f, 0x15 },
+        { 0x0151, 0x01 }, { 0x0168, 0x03 }, { 0x014a, 0x03 }, { 0x0161, 0x03 },
+    };
     TPS2Request<7> request;
+    TPS2Request<> batch;
+    int i;
     
     if (!enterCommandMode()) {
         goto error;
@@ -2420,40 +2795,29 @@ bool ApplePS2ALPSGlidePoint::hwInitV4() {
     
     DEBUG_LOG("now setting a bunch of regs\n");
     
-    if (!commandModeWriteReg(0x0007, 0x8c)) {
-        goto error;
-    }
-    
-    if (!commandModeWriteReg(0x0149, 0x03)) {
-        goto error;
-    }
-    
-    if (!commandModeWriteReg(0x0160, 0x03)) {
-        goto error;
-    }
-    
-    if (!commandModeWriteReg(0x017f, 0x15)) {
-        goto error;
-    }
-    
-    if (!commandModeWriteReg(0x0151, 0x01)) {
-        goto error;
-    }
-    
-    if (!commandModeWriteReg(0x0168, 0x03)) {
-        goto error;
+    // as many register writes per request as will fit, exit with the last
+    for (i = 0; i < countof(regs); i++) {
+        if (!appendWriteReg(&batch, regs[i].addr, regs[i].value)) {
+            if (!submitCommands(&batch)) {
+                goto error;
+            }
+            batch.commandsCount = 0;
+            if (!appendWriteReg(&batch, regs[i].addr, regs[i].value)) {
+                goto error;
+            }
+        }
     }
-    
-    if (!commandModeWriteReg(0x014a, 0x03)) {
-        goto error;
+    if (!appendExitCommandMode(&batch)) {
+        if (!submitCommands(&batch)) {
+            goto error;
+        }
+        batch.commandsCount = 0;
+        appendExitCommandMode(&batch);
     }
-    
-    if (!commandModeWriteReg(0x0161, 0x03)) {
+    if (!submitCommands(&batch)) {
         goto error;
     }
     
-    exitCommandMode();
-    
     /*
      * This sequence changes the output from a 9-byte to an
      * 8-byte format. All the same data seems to be present,
@@ -2696,9 +3060,8 @@ void ApplePS2ALPSGlidePoint::setDefaults() {
             break;
         case ALPS_PROTO_V3:
             hw_init = &ApplePS2ALPSGlidePoint::hwInitV3;
-            process_packet = &ApplePS2ALPSGlidePoint::processPacketV3;
+            process_packet = &ApplePS2ALPSGlidePoint::processPacketV3<&ApplePS2ALPSGlidePoint::decodePinnacle>;
             //            set_abs_params = alps_set_abs_params_mt;
-            decode_fields = &ApplePS2ALPSGlidePoint::decodePinnacle;
             priv.nibble_commands = alps_v3_nibble_commands;
             priv.addr_command = kDP_MouseResetWrap;
             
@@ -2708,9 +3071,8 @@ void ApplePS2ALPSGlidePoint::setDefaults() {
             break;
         case ALPS_PROTO_V3_RUSHMORE:
             hw_init = &ApplePS2ALPSGlidePoint::hwInitRushmoreV3;
-            process_packet = &ApplePS2ALPSGlidePoint::processPacketV3;
+            process_packet = &ApplePS2ALPSGlidePoint::processPacketV3<&ApplePS2ALPSGlidePoint::decodeRushmore>;
             //            set_abs_params = alps_set_abs_params_mt;
-            decode_fields = &ApplePS2ALPSGlidePoint::decodeRushmore;
             priv.nibble_commands = alps_v3_nibble_commands;
             priv.addr_command = kDP_MouseResetWrap;
             priv.x_bits = 16;
@@ -2729,8 +3091,7 @@ void ApplePS2ALPSGlidePoint::setDefaults() {
             break;
         case ALPS_PROTO_V5:
             hw_init = &ApplePS2ALPSGlidePoint::hwInitDolphinV1;
-            process_packet = &ApplePS2ALPSGlidePoint::alps_process_touchpad_packet_v3_v5;
-            decode_fields = &ApplePS2ALPSGlidePoint::decodeDolphin;
+            process_packet = &ApplePS2ALPSGlidePoint::alps_process_touchpad_packet_v3_v5<&ApplePS2ALPSGlidePoint::decodeDolphin>;
             //            set_abs_params = alps_set_abs_params_mt;
             priv.nibble_commands = alps_v3_nibble_commands;
             priv.addr_command = kDP_MouseResetWrap;
@@ -2746,7 +3107,6 @@ void ApplePS2ALPSGlidePoint::setDefaults() {
         case ALPS_PROTO_V7:
             hw_init = &ApplePS2ALPSGlidePoint::hwInitV7;
             process_packet = &ApplePS2ALPSGlidePoint::processPacketV7;
-            decode_fields = &ApplePS2ALPSGlidePoint::decodeV7;
             priv.nibble_commands = alps_v3_nibble_commands;
             priv.addr_command = kDP_MouseResetWrap;
             priv.byte0 = 0x48;
@@ -2770,29 +3130,203 @@ void ApplePS2ALPSGlidePoint::setDefaults() {
     }
 }
 
-bool ApplePS2ALPSGlidePoint::matchTable(ALPSStatus_t *e7, ALPSStatus_t *ec) {
-    const struct alps_model_info *model;
+/*
+ * Build the bitmap position tables used by processBitmap. A run of
+ * num_bits set bits starting at start_bit is centered at
+ * (2 * start_bit + num_bits - 1) / 2 bits, which maps onto the axis as
+ * max * (2 * start_bit + num_bits - 1) / (2 * (bits - 1)). Every possible
+ * index is precomputed, with the axis reversal for the protocol folded in,
+ * so no multiply or divide is left on the packet path.
+ */
+void ApplePS2ALPSGlidePoint::setupMaxes() {
     int i;
     
-    for (i = 0; i < ARRAY_SIZE(alps_model_data); i++) {
-        model = &alps_model_data[i];
+    for (i = 0; i < 2 * ALPS_BITMAP_MAX_BITS; i++) {
+        priv.x_bitmap_pos[i] = priv.x_bits > 1 ? (priv.x_max * i) / (2 * (priv.x_bits - 1)) : 0;
+        priv.y_bitmap_pos[i] = priv.y_bits > 1 ? (priv.y_max * i) / (2 * (priv.y_bits - 1)) : 0;
         
-        if (!memcmp(e7->bytes, model->signature, sizeof(model->signature)) &&
-            (!model->command_mode_resp ||
-             model->command_mode_resp == ec->bytes[2])) {
-                
-                priv.proto_version = model->proto_version;
-                setDefaults();
-                
-                priv.flags = model->flags;
-                priv.byte0 = model->byte0;
-                priv.mask0 = model->mask0;
-                
-                return true;
+        /* x-bitmap order is reversed on v5 touchpads  */
+        if (priv.proto_version == ALPS_PROTO_V5)
+            priv.x_bitmap_pos[i] = priv.x_max - priv.x_bitmap_pos[i];
+        
+        /* y-bitmap order is reversed on v3 and v4 touchpads  */
+        if (priv.proto_version == ALPS_PROTO_V3 || priv.proto_version == ALPS_PROTO_V4)
+            priv.y_bitmap_pos[i] = priv.y_max - priv.y_bitmap_pos[i];
+    }
+    
+    /*
+     * Coordinate scale for dispatchEventsWithInfo, as a 16.16 fixed point
+     * multiplier per axis: scale x & y to the axis which has the most
+     * resolution, then scale all touchpads' x axis to about 6000 to be able
+     * to use the same divisor for all models (Dr Hurt). Rounded up, so
+     * whole number results are not truncated one unit short.
+     */
+    SInt64 num = 1, den = 1;
+    if (priv.proto_version == ALPS_PROTO_V2) {
+        num = 6;
+    } else if (priv.proto_version > ALPS_PROTO_V2 && priv.proto_version < ALPS_PROTO_V5) {
+        num = 3;
+    } else if (priv.proto_version == ALPS_PROTO_V5) {
+        num = 22; den = 5;      /* 4.4 */
+    } else if (priv.proto_version == ALPS_PROTO_V7) {
+        num = 3; den = 2;       /* 1.5 */
+    }
+    SInt64 xnum = num, xden = den, ynum = num, yden = den;
+    if (xupmm > 0 && yupmm > 0) {
+        if (xupmm < yupmm) {
+            xnum *= yupmm;
+            xden *= xupmm;
+        } else if (xupmm > yupmm) {
+            ynum *= xupmm;
+            yden *= yupmm;
+        }
+    }
+    priv.x_scale = ((xnum << 16) + xden - 1) / xden;
+    priv.y_scale = ((ynum << 16) + yden - 1) / yden;
+}
+
+void ApplePS2ALPSGlidePoint::setParamPropertiesGated(OSDictionary* config) {
+    super::setParamPropertiesGated(config);
+    
+    // UnitsPerMMX/UnitsPerMMY may have changed the scale
+    setupMaxes();
+    
+    if (NULL == config)
+        return;
+    
+    if (OSArray *overrides = OSDynamicCast(OSArray, config->getObject(kModelOverrides)))
+        loadModelOverrides(overrides);
+}
+
+static inline bool modelMatches(const struct alps_model_info *model, ALPSStatus_t *e7, ALPSStatus_t *ec) {
+    return !memcmp(e7->bytes, model->signature, sizeof(model->signature)) &&
+        (!model->command_mode_resp || model->command_mode_resp == ec->bytes[2]);
+}
+
+bool ApplePS2ALPSGlidePoint::matchTable(ALPSStatus_t *e7, ALPSStatus_t *ec) {
+    const struct alps_model_info *model = NULL;
+    int i;
+    
+    // overrides first, so they can replace a built-in entry
+    for (i = 0; i < _modelOverrideCount; i++) {
+        if (modelMatches(&_modelOverrides[i], e7, ec)) {
+            model = &_modelOverrides[i];
+            break;
+        }
+    }
+    
+    if (!model) {
+        // alps_model_data is sorted by signature: find the first entry with
+        // this signature, then check the command mode response of each
+        int lo = 0, hi = ARRAY_SIZE(alps_model_data);
+        while (lo < hi) {
+            int mid = (lo + hi) / 2;
+            if (memcmp(alps_model_data[mid].signature, e7->bytes, sizeof(e7->bytes)) < 0)
+                lo = mid + 1;
+            else
+                hi = mid;
+        }
+        for (i = lo; i < ARRAY_SIZE(alps_model_data) &&
+             !memcmp(alps_model_data[i].signature, e7->bytes, sizeof(e7->bytes)); i++) {
+            if (modelMatches(&alps_model_data[i], e7, ec)) {
+                model = &alps_model_data[i];
+                break;
             }
+        }
     }
     
-    return false;
+    if (!model)
+        return false;
+    
+    priv.proto_version = model->proto_version;
+    setDefaults();
+    
+    priv.flags = model->flags;
+    priv.byte0 = model->byte0;
+    priv.mask0 = model->mask0;
+    
+    return true;
+}
+
+const alps_protocol_rule *ApplePS2ALPSGlidePoint::matchProtocolRule(ALPSStatus_t *e7, ALPSStatus_t *ec) {
+    for (int i = 0; i < ARRAY_SIZE(alps_protocol_rules); i++) {
+        const struct alps_protocol_rule *rule = &alps_protocol_rules[i];
+        
+        if (rule->match_e7 && memcmp(e7->bytes, rule->e7, sizeof(rule->e7)))
+            continue;
+        if (ec->bytes[0] == rule->ec0 &&
+            (ec->bytes[1] & rule->ec1_mask) == rule->ec1 &&
+            ec->bytes[2] >= rule->ec2_min && ec->bytes[2] <= rule->ec2_max)
+            return rule;
+    }
+    return NULL;
+}
+
+// - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+
+static bool parseModelOverride(const char *psz, struct alps_model_info *model) {
+    // psz is of the form: "e7 e7 e7 ec proto byte0 mask0 flags", all hex
+    // (same fields as alps_model_data), for example:
+    //      "73 02 64 8a 400 8f 8f 0"
+    
+    unsigned fields[8];
+    int i;
+    
+    for (i = 0; i < 8; i++) {
+        while (*psz == ' ')
+            ++psz;
+        if (!*psz)
+            return false;
+        unsigned n = 0;
+        for (; *psz && *psz != ' '; ++psz) {
+            n <<= 4;
+            if (*psz >= '0' && *psz <= '9')
+                n += *psz - '0';
+            else if (*psz >= 'a' && *psz <= 'f')
+                n += *psz - 'a' + 10;
+            else if (*psz >= 'A' && *psz <= 'F')
+                n += *psz - 'A' + 10;
+            else
+                return false;
+        }
+        if (n > (i == 4 ? 0xFFFF : 0xFF))
+            return false;
+        fields[i] = n;
+    }
+    
+    model->signature[0] = fields[0];
+    model->signature[1] = fields[1];
+    model->signature[2] = fields[2];
+    model->command_mode_resp = fields[3];
+    model->proto_version = fields[4];
+    model->byte0 = fields[5];
+    model->mask0 = fields[6];
+    model->flags = fields[7];
+    return true;
+}
+
+void ApplePS2ALPSGlidePoint::loadModelOverrides(OSArray *array) {
+    _modelOverrideCount = 0;
+    
+    int count = array->getCount();
+    for (int i = 0; i < count; i++) {
+        OSString *string = OSDynamicCast(OSString, array->getObject(i));
+        if (!string)
+            continue;
+        const char *psz = string->getCStringNoCopy();
+        // check for comment
+        if (';' == *psz)
+            continue;
+        if (_modelOverrideCount >= kMaxModelOverrides) {
+            IOLog("ALPS: too many model overrides, ignoring \"%s\"\n", psz);
+            continue;
+        }
+        if (!parseModelOverride(psz, &_modelOverrides[_modelOverrideCount])) {
+            IOLog("ALPS: invalid model override: \"%s\"\n", psz);
+            continue;
+        }
+        ++_modelOverrideCount;
+    }
 }
 
 IOReturn ApplePS2ALPSGlidePoint::identify() {
@@ -2826,40 +3360,28 @@ IOReturn ApplePS2ALPSGlidePoint::identify() {
         return kIOReturnIOError;
     }
     
+    // (checked again by fastInit)
+    _identityE7 = e7;
+    
     if (matchTable(&e7, &ec)) {
         return 0;
-        
-    } else if (e7.bytes[0] == 0x73 && e7.bytes[1] == 0x03 && e7.bytes[2] == 0x50 &&
-               ec.bytes[0] == 0x73 && (ec.bytes[1] == 0x01 || ec.bytes[1] == 0x02)) {
-        priv.proto_version = ALPS_PROTO_V5;
-        setDefaults();
-        IOLog("ALPS: Found a V5 Dolphin touchpad with ID: E7=0x%02x 0x%02x 0x%02x, EC=0x%02x 0x%02x 0x%02x\n", e7.bytes[0], e7.bytes[1], e7.bytes[2], ec.bytes[0], ec.bytes[1], ec.bytes[2]);
-        if (ec.bytes[1] == 0x02) {
-            hw_init = &ApplePS2ALPSGlidePoint::alps_hw_init_dolphin_v2;
-            IOLog("ALPS: Dolphin hardware rev. 2 detected. Support is experimental...\n");
-        }
-    } else if (ec.bytes[0] == 0x88 &&
-               ((ec.bytes[1] & 0xf0) == 0xb0 || (ec.bytes[1] & 0xf0) == 0xc0)) {
-        priv.proto_version = ALPS_PROTO_V7;
-        setDefaults();
-        IOLog("ALPS: Found a V7 touchpad with ID: E7=0x%02x 0x%02x 0x%02x, EC=0x%02x 0x%02x 0x%02x\n", e7.bytes[0], e7.bytes[1], e7.bytes[2], ec.bytes[0], ec.bytes[1], ec.bytes[2]);
-    } else if (ec.bytes[0] == 0x88 && ec.bytes[1] == 0x08) {
-        priv.proto_version = ALPS_PROTO_V3_RUSHMORE;
-        setDefaults();
-        IOLog("ALPS: Found a V3 Rushmore touchpad with ID: E7=0x%02x 0x%02x 0x%02x, EC=0x%02x 0x%02x 0x%02x\n", e7.bytes[0], e7.bytes[1], e7.bytes[2], ec.bytes[0], ec.bytes[1], ec.bytes[2]);
-        
-    } else if (ec.bytes[0] == 0x88 && ec.bytes[1] == 0x07 &&
-               ec.bytes[2] >= 0x90 && ec.bytes[2] <= 0x9d) {
-        priv.proto_version = ALPS_PROTO_V3;
-        setDefaults();
-        IOLog("ALPS: Found a V3 Pinnacle touchpad with ID: E7=0x%02x 0x%02x 0x%02x, EC=0x%02x 0x%02x 0x%02x\n", e7.bytes[0], e7.bytes[1], e7.bytes[2], ec.bytes[0], ec.bytes[1], ec.bytes[2]);
-        
-    } else {
+    }
+    
+    const struct alps_protocol_rule *rule = matchProtocolRule(&e7, &ec);
+    if (!rule) {
         IOLog("ALPS: Touchpad id didn't match V1-V5: E7=0x%02x 0x%02x 0x%02x, EC=0x%02x 0x%02x 0x%02x\n",
               e7.bytes[0], e7.bytes[1], e7.bytes[2], ec.bytes[0], ec.bytes[1], ec.bytes[2]);
         return kIOReturnInvalid;
     }
     
+    priv.proto_version = rule->proto_version;
+    setDefaults();
+    IOLog("ALPS: Found a %s touchpad with ID: E7=0x%02x 0x%02x 0x%02x, EC=0x%02x 0x%02x 0x%02x\n", rule->name, e7.bytes[0], e7.bytes[1], e7.bytes[2], ec.bytes[0], ec.bytes[1], ec.bytes[2]);
+    if (rule->rule_flags & ALPS_RULE_DOLPHIN_V2) {
+        hw_init = &ApplePS2ALPSGlidePoint::alps_hw_init_dolphin_v2;
+        IOLog("ALPS: Dolphin hardware rev. 2 detected. Support is experimental...\n");
+    }
+    
     /* Save the Firmware version */
     memcpy(priv.fw_ver, ec.bytes, 3);
     return 0;
@@ -54,6 +54,19 @@ enum V7_PACKET_ID {
     V7_PACKET_ID_UNKNOWN,
 };
 
+/*
+ * enum ALPS_MP_STATE - position in a multi-packet (bitmap) sequence
+ * ALPS_MP_IDLE: No sequence in progress, the next packet starts a new frame.
+ * ALPS_MP_BITMAP: V3/V5 position packet decoded, its bitmap packet is next.
+ * ALPS_MP_V4_1, ALPS_MP_V4_2: V4 bitmap parts 1 and 2 are next.
+ */
+enum ALPS_MP_STATE {
+    ALPS_MP_IDLE,
+    ALPS_MP_BITMAP,
+    ALPS_MP_V4_1 = ALPS_MP_BITMAP,
+    ALPS_MP_V4_2,
+};
+
 
 /**
  * struct alps_model_info - touchpad ID table
@@ -81,6 +94,34 @@ struct alps_model_info {
     UInt8 flags;
 };
 
+/**
+ * struct alps_protocol_rule - classification of touchpads not in the ID table
+ * @e7: E7 response string to match, if @match_e7.
+ * @match_e7: Whether the E7 response must match @e7.
+ * @ec0: First byte of the EC response.
+ * @ec1, @ec1_mask: Second byte of the EC response, ANDed with ec1_mask,
+ *   should match ec1.
+ * @ec2_min, @ec2_max: Range of the third byte of the EC response.
+ * @proto_version: Indicates V3/V5/V7/...
+ * @rule_flags: ALPS_RULE_* variations on the protocol's defaults.
+ * @name: Touchpad name for the log.
+ */
+struct alps_protocol_rule {
+    UInt8 e7[3];
+    bool match_e7;
+    UInt8 ec0;
+    UInt8 ec1, ec1_mask;
+    UInt8 ec2_min, ec2_max;
+    UInt16 proto_version;
+    UInt8 rule_flags;
+    const char *name;
+};
+
+#define ALPS_RULE_DOLPHIN_V2    0x01    /* Dolphin hardware rev. 2 */
+
+#define kModelOverrides         "ModelOverrides"
+#define kMaxModelOverrides      8
+
 /**
  * struct alps_nibble_commands - encodings for register accesses
  * @command: PS/2 command used for the nibble
@@ -102,11 +143,29 @@ struct alps_bitmap_point {
     int num_bits;
 };
 
+#define ALPS_BITMAP_MAX_BITS 32 /* x_map/y_map are 32-bit */
+
 struct input_mt_pos {
     UInt32 x;
     UInt32 y;
 };
 
+/**
+ * struct alps_slot - a V7 contact tracked from packet to packet
+ * @x: Last known X position, as decoded.
+ * @y: Last known Y position, as decoded.
+ * @id: Tracking id, a new one is given to every contact that touches down.
+ * @active: The slot holds a contact.
+ */
+#define V7_SLOTS        2
+
+struct alps_slot {
+    int x;
+    int y;
+    UInt16 id;
+    bool active;
+};
+
 /**
  * struct alps_fields - decoded version of the report packet
  * @x_map: Bitmap of active X positions for MT.
@@ -164,10 +223,13 @@ class ApplePS2ALPSGlidePoint;
  * @x_bits: Number of X bits in the MT bitmap.
  * @y_bits: Number of Y bits in the MT bitmap.
  * @prev_fin: Finger bit from previous packet.
- * @multi_packet: Multi-packet data in progress.
- * @multi_data: Saved multi-packet data.
- * @f: Decoded packet data fields.
+ * @mp_state: Multi-packet sequence in progress (ALPS_MP_*).
+ * @f: Decoded packet data fields, assembled across a multi-packet sequence.
  * @quirks: Bitmap of ALPS_QUIRK_*.
+ * @x_bitmap_pos: Bitmap X position, by 2 * start_bit + num_bits - 1.
+ * @y_bitmap_pos: Bitmap Y position, by 2 * start_bit + num_bits - 1.
+ * @x_scale: X scale (16.16 fixed point) applied before dispatch.
+ * @y_scale: Y scale (16.16 fixed point) applied before dispatch.
  */
 struct alps_data {
     /* these are autodetected when the device is identified */
@@ -185,17 +247,24 @@ struct alps_data {
     unsigned int y_res;
     
     SInt32 prev_fin;
-    SInt32 multi_packet;
+    SInt32 mp_state;
     int second_touch;
-    UInt8 multi_data[6];
     struct alps_fields f;
     UInt8 quirks;
     
     int pktsize = 6;
+    
+    /* built by setupMaxes() from x_max/x_bits and y_max/y_bits */
+    UInt32 x_bitmap_pos[2 * ALPS_BITMAP_MAX_BITS];
+    UInt32 y_bitmap_pos[2 * ALPS_BITMAP_MAX_BITS];
+    SInt64 x_scale;
+    SInt64 y_scale;
 };
 
 // Pulled out of alps_data, now saved as vars on class
 // makes invoking a little easier
+// (decode_fields is bound at compile time, as a template argument of the
+// V3/V5 packet processing, so the decoder can be inlined)
 typedef bool (ApplePS2ALPSGlidePoint::*hw_init)();
 typedef bool (ApplePS2ALPSGlidePoint::*decode_fields)(struct alps_fields *f, UInt8 *p);
 typedef void (ApplePS2ALPSGlidePoint::*process_packet)(UInt8 *packet);
@@ -228,13 +297,32 @@ private:
     alps_data priv;
     
     hw_init hw_init;
-    decode_fields decode_fields;
     process_packet process_packet;
     //    set_abs_params set_abs_params;
     
+    // identity from the last full init, for the fast path (see fastInit)
+    bool _identityCached;
+    ALPSStatus_t _identityE7;
+    alps_data _identity;
+    hw_init _identityInit;
+    
+    // alps_model_info entries from the ModelOverrides array, checked first
+    alps_model_info _modelOverrides[kMaxModelOverrides];
+    int _modelOverrideCount;
+    
+    // time taken by each init path, as published in "InitTimings"
+    TimeHistogram _initFull;
+    TimeHistogram _initFast;
+    UInt32 _initFallbacks;
+    
+    // sub-unit remainders of the V7 trackstick curve (see scaleTrackstick)
+    int _trackstickrestx, _trackstickresty;
+    
+    // V7 contacts, kept in the same slot while they stay down (see trackSlotsV7)
+    alps_slot _slots[V7_SLOTS];
+    UInt16 _nextSlotId;
+    
 protected:
-    int _multiPacket;
-    UInt8 _multiData[6];
     IOGBounds _bounds;
     
     virtual void dispatchRelativePointerEventWithPacket(UInt8 *packet,
@@ -260,6 +348,27 @@ protected:
     
     bool commandModeSetAddr(int addr);
     
+    // command mode request composition (several operations per request)
+    bool appendCommand(TPS2Request<> *request, PS2CommandEnum command, UInt8 data);
+    
+    bool appendNibble(TPS2Request<> *request, int nibble);
+    
+    bool appendEnterCommandMode(TPS2Request<> *request);
+    
+    bool appendExitCommandMode(TPS2Request<> *request);
+    
+    bool appendSetAddr(TPS2Request<> *request, int addr);
+    
+    bool appendReadReg(TPS2Request<> *request, int addr, int *result);
+    
+    bool appendWriteReg(TPS2Request<> *request, UInt8 value);
+    
+    bool appendWriteReg(TPS2Request<> *request, int addr, UInt8 value);
+    
+    bool submitCommands(TPS2Request<> *request);
+    
+    int readRegResult(TPS2Request<> *request, int result, int addr);
+    
     bool passthroughModeV3(int regBase, bool enable);
     
     bool passthroughModeV2(bool enable);
@@ -274,10 +383,12 @@ protected:
     
     bool setSampleRateAndEnable(UInt8 rate);
     
+    template <decode_fields decode>
     void processPacketV3(UInt8 *packet);
     
     void processTrackstickPacketV3(UInt8 * packet);
     
+    template <decode_fields decode>
     void alps_process_touchpad_packet_v3_v5(UInt8 * packet);
     
     int processBitmap(struct alps_data *priv,
@@ -285,6 +396,8 @@ protected:
     
     PS2InterruptResult interruptOccurred(UInt8 data);
     
+    void resyncPacket(UInt8 *packet);
+    
     void packetReady();
     
     void setTouchPadEnable(bool enable);
@@ -313,9 +426,12 @@ protected:
     
     bool decodeV7(struct alps_fields *f, UInt8 *p);
     
+    void trackSlotsV7(struct input_mt_pos *mt, bool update_only);
+    
     void processPacketV4(UInt8 *packet);
     
     void processTrackstickPacketV7(UInt8 *packet);
+    int scaleTrackstick(int delta, int& rest);
     
     void processTouchpadPacketV7(UInt8 *packet);
     
@@ -349,10 +465,20 @@ protected:
     
     bool matchTable(ALPSStatus_t *e7, ALPSStatus_t *ec);
     
+    const alps_protocol_rule *matchProtocolRule(ALPSStatus_t *e7, ALPSStatus_t *ec);
+    
+    void loadModelOverrides(OSArray *array);
+    
     IOReturn identify();
     
+    bool fastInit();
+    
+    void publishInitTimings();
+    
     void setupMaxes();
     
+    virtual void setParamPropertiesGated(OSDictionary* dict);
+    
     bool v1v2MagicEnable();
     
     bool alps_get_v3_v7_resolution(int reg_pitch);